@@ -7,10 +7,17 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "polkitagent.h"
 #include "actions.h"
 #include "util.h"
+#include "scan.h"
+#include "parser.h"
+#include "probes.h"
+#include "introspect.h"
+#include "snapshot.h"
+#include "output.h"
 
 // --filter-actions=auth,yes,admin,no,NotAuthorized
 //
@@ -68,15 +75,39 @@ G_GNUC_UNUSED static impauth_t str_to_impauth(const gchar *authorization)
     g_assert_not_reached();
 }
 
+// Ask polkit for every registered action.
+//
+// Returns NULL on error, or an a(ssssssuuua{ss}) you should free with g_variant_unref().
+static GVariant * enumerate_actions(GDBusConnection *bus)
+{
+    GDBusMessage *request;
+    GVariant *body;
+    GVariant *actions;
+
+    request = g_dbus_method("org.freedesktop.PolicyKit1",
+                            "/org/freedesktop/PolicyKit1/Authority",
+                            "org.freedesktop.PolicyKit1.Authority",
+                            "EnumerateActions");
+
+    g_dbus_message_set_body(request, g_variant_new ("(s)", "C"));
+
+    if (!(body = g_dbus_simple_send(bus, request, "(a(ssssssuuua{ss}))"))) {
+        g_message("failed to enumerate polkit actions");
+        return NULL;
+    }
+
+    actions = g_variant_get_child_value(body, 0);
+    g_variant_unref(body);
+    return actions;
+}
+
 // Return a list of D-Bus names that the server reports as an array of strings
 // in a GVariant.
 void get_action_list(GDBusConnection *bus, const gchar *filter)
 {
-    GVariantIter *iter;
+    GVariantIter iter;
     GVariant *actions;
     GVariant *annotations;
-    GDBusMessage *request;
-    GDBusMessage *reply;
     gchar **filters;
     gchar *action;
     gchar *description;
@@ -88,34 +119,29 @@ void get_action_list(GDBusConnection *bus, const gchar *filter)
     guint  implicit_inactive;
     guint  implicit_active;
 
-    request = g_dbus_method("org.freedesktop.PolicyKit1",
-                            "/org/freedesktop/PolicyKit1/Authority",
-                            "org.freedesktop.PolicyKit1.Authority",
-                            "EnumerateActions");
-
-    g_dbus_message_set_body(request, g_variant_new ("(s)", "C"));
+    if (!(actions = enumerate_actions(bus))) {
+        return;
+    }
 
     filters = g_strsplit(filter, ",", 0);
-    reply   = g_dbus_send(bus, request, G_DBUS_SEND_MESSAGE_FLAGS_NONE, timeout, NULL, NULL, NULL);
-    actions = g_dbus_message_get_body(reply);
 
     // Get an iterator for each ActionDescription structure.
-    g_variant_get(actions, "(a(ssssssuuua{ss}))", &iter);
+    g_variant_iter_init(&iter, actions);
 
-    g_print("%-64s Any/Inactive/Active\n", "Action");
+    report_action_header();
 
 nomatch:
-    while (g_variant_iter_loop(iter, "(ssssssuuua{ss})",
-                                     &action,
-                                     &description,
-                                     &message,
-                                     &vendor,
-                                     &vendorurl,
-                                     &icon,
-                                     &implicit_any,
-                                     &implicit_inactive,
-                                     &implicit_active,
-                                     &annotations)) {
+    while (g_variant_iter_loop(&iter, "(ssssssuuua{ss})",
+                                      &action,
+                                      &description,
+                                      &message,
+                                      &vendor,
+                                      &vendorurl,
+                                      &icon,
+                                      &implicit_any,
+                                      &implicit_inactive,
+                                      &implicit_active,
+                                      &annotations)) {
 
         for (gchar **p = filters; *p; p++) {
             if (g_str_has_prefix(*p, "active=")) {
@@ -133,13 +159,350 @@ nomatch:
             goto nomatch;
         }
 
-        g_print("%-64s %s/%s/%s\n", action, impauth_to_shortstr(implicit_any),
-                                            impauth_to_shortstr(implicit_inactive),
-                                            impauth_to_shortstr(implicit_active));
+        report_action(action, impauth_to_shortstr(implicit_any),
+                              impauth_to_shortstr(implicit_inactive),
+                              impauth_to_shortstr(implicit_active));
     }
 
-    g_object_unref(reply);
-    g_object_unref(request);
+    g_strfreev(filters);
+    g_variant_unref(actions);
     return;
 }
 
+// --check-actions=self,uid=1000,active,inactive
+//
+// Ask polkit whether each subject is authorized for every action, after any
+// rules have been applied. This is pkcheck for every action at once, without
+// user interaction, so it never causes an authentication prompt.
+//
+// Subjects are:
+//
+//  self            This connection to the bus.
+//  uid=N           A process of user N, in the session of dbus-map.
+//  pid=N           Process N.
+//  name=NAME       The owner of a bus name.
+//  session=ID      A logind session.
+//  active          The first active logind session.
+//  inactive        The first inactive logind session.
+//
+// Checking a subject that belongs to another user requires privileges, those
+// checks are reported as errors.
+
+// How many CheckAuthorization calls to keep in flight, unless --pipeline is
+// used. The system bus allows 128 outstanding replies per connection.
+#define CHECK_ACTIONS_WINDOW 64
+
+// Options
+gchar *check_action_subjects;
+
+typedef struct {
+    gchar       *label;
+    GVariant    *subject;       // (sa{sv})
+} subject_t;
+
+typedef struct {
+    GDBusConnection *bus;
+    GPtrArray   *actions;
+    GPtrArray   *subjects;
+    const gchar **results;      // One per action and subject, action major.
+    guint       next;           // The next result to check.
+    guint       inflight;
+} matrix_t;
+
+typedef struct {
+    matrix_t    *matrix;
+    guint       index;
+} check_request_t;
+
+static void free_subject(subject_t *subject)
+{
+    g_variant_unref(subject->subject);
+    g_free(subject->label);
+    g_free(subject);
+}
+
+// Find the first logind session that is active, or inactive.
+//
+// Returns NULL on error, or a string you should free with g_free().
+static gchar * find_logind_session(GDBusConnection *bus, gboolean active)
+{
+    GDBusMessage *request;
+    GVariantIter iter;
+    GVariant *sessions;
+    GVariant *list;
+    GVariant *reply;
+    GVariant *value;
+    const gchar *id;
+    const gchar *path;
+    gchar *result = NULL;
+
+    request = g_dbus_method("org.freedesktop.login1",
+                            "/org/freedesktop/login1",
+                            "org.freedesktop.login1.Manager",
+                            "ListSessions");
+
+    if (!(sessions = g_dbus_simple_send(bus, request, "(a(susso))"))) {
+        return NULL;
+    }
+
+    list = g_variant_get_child_value(sessions, 0);
+
+    g_variant_iter_init(&iter, list);
+
+    while (result == NULL && g_variant_iter_next(&iter, "(&su&s&s&o)", &id, NULL, NULL, NULL, &path)) {
+        request = g_dbus_method("org.freedesktop.login1",
+                                path,
+                                "org.freedesktop.DBus.Properties",
+                                "Get");
+
+        g_dbus_message_set_body(request, g_variant_new("(ss)", "org.freedesktop.login1.Session", "Active"));
+
+        if (!(reply = g_dbus_simple_send(bus, request, "(v)"))) {
+            continue;
+        }
+
+        g_variant_get(reply, "(v)", &value);
+
+        if (g_variant_is_of_type(value, G_VARIANT_TYPE("b")) && g_variant_get_boolean(value) == active) {
+            result = g_strdup(id);
+        }
+
+        g_variant_unref(value);
+        g_variant_unref(reply);
+    }
+
+    g_variant_unref(list);
+    g_variant_unref(sessions);
+    return result;
+}
+
+// Returns NULL on error, or a subject you should free with free_subject().
+static subject_t * parse_subject(GDBusConnection *bus, const gchar *spec)
+{
+    GVariantBuilder details;
+    const gchar *kind;
+    subject_t *subject;
+    gchar *session = NULL;
+    gchar *end;
+    guint64 value = 0;
+
+    g_variant_builder_init(&details, G_VARIANT_TYPE("a{sv}"));
+
+    if (g_str_has_prefix(spec, "uid=") || g_str_has_prefix(spec, "pid=")) {
+        value = g_ascii_strtoull(spec + strlen("uid="), &end, 10);
+
+        if (*end != '\0' || end == spec + strlen("uid=") || value > G_MAXINT32) {
+            goto invalid;
+        }
+    }
+
+    if (g_strcmp0(spec, "self") == 0) {
+        kind = "system-bus-name";
+        g_variant_builder_add(&details, "{sv}", "name", g_variant_new_string(bus ? g_dbus_connection_get_unique_name(bus) : ""));
+    } else if (g_str_has_prefix(spec, "uid=")) {
+        kind = "unix-process";
+        g_variant_builder_add(&details, "{sv}", "pid", g_variant_new_uint32(getpid()));
+        g_variant_builder_add(&details, "{sv}", "start-time", g_variant_new_uint64(0));
+        g_variant_builder_add(&details, "{sv}", "uid", g_variant_new_int32(value));
+    } else if (g_str_has_prefix(spec, "pid=")) {
+        kind = "unix-process";
+        g_variant_builder_add(&details, "{sv}", "pid", g_variant_new_uint32(value));
+        g_variant_builder_add(&details, "{sv}", "start-time", g_variant_new_uint64(0));
+    } else if (g_str_has_prefix(spec, "name=") && g_dbus_is_name(spec + strlen("name="))) {
+        kind = "system-bus-name";
+        g_variant_builder_add(&details, "{sv}", "name", g_variant_new_string(spec + strlen("name=")));
+    } else if (g_str_has_prefix(spec, "session=") && spec[strlen("session=")]) {
+        kind = "unix-session";
+        g_variant_builder_add(&details, "{sv}", "session-id", g_variant_new_string(spec + strlen("session=")));
+    } else if (g_strcmp0(spec, "active") == 0 || g_strcmp0(spec, "inactive") == 0) {
+        if (!(session = find_logind_session(bus, g_strcmp0(spec, "active") == 0))) {
+            g_message("no %s logind session found", spec);
+            g_variant_builder_clear(&details);
+            return NULL;
+        }
+
+        kind = "unix-session";
+        g_variant_builder_add(&details, "{sv}", "session-id", g_variant_new_string(session));
+    } else {
+        goto invalid;
+    }
+
+    subject             = g_new0(subject_t, 1);
+    subject->label      = session ? g_strdup_printf("%s:%s", spec, session) : g_strdup(spec);
+    subject->subject    = g_variant_ref_sink(g_variant_new("(sa{sv})", kind, &details));
+
+    g_free(session);
+    return subject;
+
+  invalid:
+    g_message("unrecognised polkit subject %s", spec);
+    g_variant_builder_clear(&details);
+    return NULL;
+}
+
+static const gchar * parse_check_reply(GDBusMessage *reply)
+{
+    GVariant *body;
+    gboolean authorized;
+    gboolean challenge;
+
+    if (reply == NULL) {
+        return "Error";
+    }
+
+    body = g_dbus_message_get_body(reply);
+
+    if (g_dbus_message_get_message_type(reply) == G_DBUS_MESSAGE_TYPE_ERROR) {
+        g_debug("CheckAuthorization failed, %s", g_dbus_message_get_error_name(reply));
+        return "Error";
+    }
+
+    if (g_strcmp0(g_variant_get_type_string(body), "((bba{ss}))") != 0) {
+        g_debug("unexpected CheckAuthorization reply type %s", g_variant_get_type_string(body));
+        return "Error";
+    }
+
+    g_variant_get(body, "((bb@a{ss}))", &authorized, &challenge, NULL);
+
+    return authorized ? "Yes" : challenge ? "Auth" : "No";
+}
+
+static void check_send_pending(matrix_t *matrix);
+
+static void check_reply_ready(GObject *source, GAsyncResult *res, gpointer data)
+{
+    check_request_t *request = data;
+    matrix_t *matrix = request->matrix;
+    GDBusMessage *reply;
+
+    matrix->inflight--;
+
+    reply = g_dbus_scan_send_finish(G_DBUS_CONNECTION(source), res, NULL);
+
+    matrix->results[request->index] = parse_check_reply(reply);
+
+    if (reply)
+        g_object_unref(reply);
+
+    check_send_pending(matrix);
+    g_free(request);
+}
+
+// Top up the window of outstanding CheckAuthorization calls.
+static void check_send_pending(matrix_t *matrix)
+{
+    guint window = introspect_pipeline > 0 ? introspect_pipeline : CHECK_ACTIONS_WINDOW;
+    guint total = matrix->actions->len * matrix->subjects->len;
+
+    while (matrix->inflight < window && matrix->next < total) {
+        check_request_t *request;
+        GDBusMessage *message;
+        subject_t *subject;
+        const gchar *action;
+
+        request         = g_new0(check_request_t, 1);
+        request->matrix = matrix;
+        request->index  = matrix->next++;
+
+        action  = g_ptr_array_index(matrix->actions, request->index / matrix->subjects->len);
+        subject = g_ptr_array_index(matrix->subjects, request->index % matrix->subjects->len);
+
+        message = g_dbus_method("org.freedesktop.PolicyKit1",
+                                "/org/freedesktop/PolicyKit1/Authority",
+                                "org.freedesktop.PolicyKit1.Authority",
+                                "CheckAuthorization");
+
+        // Flags are zero, so AllowUserInteraction is not set.
+        g_dbus_message_set_body(message, g_variant_new("(@(sa{sv})sa{ss}us)",
+                                                       subject->subject,
+                                                       action,
+                                                       NULL,
+                                                       0,
+                                                       ""));
+
+        matrix->inflight++;
+        g_dbus_scan_send_async(matrix->bus, message, check_reply_ready, request);
+        g_object_unref(message);
+    }
+}
+
+// Check every action against each subject in the comma separated list
+// subjects, and print the results as a table.
+gboolean check_action_matrix(GDBusConnection *bus, const gchar *subjects)
+{
+    GMainContext *context;
+    GVariantIter iter;
+    GVariant *actions;
+    gchar **specs;
+    const gchar *action;
+    const gchar **labels;
+    matrix_t matrix = { .bus = bus };
+
+    matrix.subjects = g_ptr_array_new_with_free_func((GDestroyNotify) free_subject);
+    specs           = g_strsplit(subjects, ",", 0);
+
+    for (gchar **p = specs; *p; p++) {
+        subject_t *subject;
+
+        if (!(subject = parse_subject(bus, *p))) {
+            g_ptr_array_unref(matrix.subjects);
+            g_strfreev(specs);
+            return false;
+        }
+
+        g_ptr_array_add(matrix.subjects, subject);
+    }
+
+    g_strfreev(specs);
+
+    if (matrix.subjects->len == 0 || !(actions = enumerate_actions(bus))) {
+        g_ptr_array_unref(matrix.subjects);
+        return false;
+    }
+
+    matrix.actions = g_ptr_array_new();
+
+    g_variant_iter_init(&iter, actions);
+
+    while (g_variant_iter_next(&iter, "(&ssssssuuu@a{ss})", &action, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL)) {
+        g_ptr_array_add(matrix.actions, (gpointer) action);
+    }
+
+    matrix.results = g_new0(const gchar *, matrix.actions->len * matrix.subjects->len);
+
+    g_debug("checking %u actions for %u subjects", matrix.actions->len, matrix.subjects->len);
+
+    // As with crawl_introspection_nodes(), use a private context so that the
+    // polkit agent thread never sees the replies.
+    context = g_main_context_new();
+
+    g_main_context_push_thread_default(context);
+
+    check_send_pending(&matrix);
+
+    while (matrix.inflight > 0) {
+        g_main_context_iteration(context, true);
+    }
+
+    g_main_context_pop_thread_default(context);
+    g_main_context_unref(context);
+
+    labels = g_new0(const gchar *, matrix.subjects->len + 1);
+
+    for (guint i = 0; i < matrix.subjects->len; i++) {
+        labels[i] = ((subject_t *) g_ptr_array_index(matrix.subjects, i))->label;
+    }
+
+    report_authorization_header(labels);
+
+    for (guint i = 0; i < matrix.actions->len; i++) {
+        report_authorization(g_ptr_array_index(matrix.actions, i), labels, &matrix.results[i * matrix.subjects->len]);
+    }
+
+    g_free(labels);
+    g_free(matrix.results);
+    g_ptr_array_unref(matrix.actions);
+    g_ptr_array_unref(matrix.subjects);
+    g_variant_unref(actions);
+    return true;
+}
@@ -2,5 +2,9 @@
 #define __ACTIONS_H
 
 void get_action_list(GDBusConnection *bus, const gchar *filter);
+gboolean check_action_matrix(GDBusConnection *bus, const gchar *subjects);
+
+// Options
+extern gchar *check_action_subjects;
 
 #endif
@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include <gio/gio.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "activation.h"
+#include "trace.h"
+
+// The bus lists activatable names alongside running ones, and the first
+// message to one of them makes the broker start it. A full scan can start
+// dozens of daemons at once this way, so there are a few alternatives:
+//
+//  --activation=skip           Don't scan names that aren't running.
+//  --activation=no-auto-start  Scan them with NO_AUTO_START, so they fail.
+//  --activation=queue[:N]      Start them with StartServiceByName, at most N
+//                              at a time, and scan each once it has started.
+//
+// In every mode except the default, all scan messages have NO_AUTO_START set,
+// so that nothing is started behind our back, e.g. if a service exits while
+// it's being scanned.
+
+// The broker gives up on activation after 25 seconds by default.
+#define ACTIVATION_TIMEOUT (25 * 1000)
+
+// Replies to StartServiceByName.
+#define DBUS_START_REPLY_SUCCESS 1
+
+// Options
+activation_policy_t activation_policy = ACTIVATION_START;
+gint activation_queue_size = 1;
+
+static GMutex activation_lock;
+static GCond activation_cond;
+static gint activations;
+
+gboolean parse_activation_policy(const gchar *value)
+{
+    if (g_strcmp0(value, "start") == 0) {
+        activation_policy = ACTIVATION_START;
+    } else if (g_strcmp0(value, "skip") == 0) {
+        activation_policy = ACTIVATION_SKIP;
+    } else if (g_strcmp0(value, "no-auto-start") == 0) {
+        activation_policy = ACTIVATION_NO_AUTO_START;
+    } else if (g_strcmp0(value, "queue") == 0) {
+        activation_policy = ACTIVATION_QUEUE;
+    } else if (g_str_has_prefix(value, "queue:")) {
+        activation_policy       = ACTIVATION_QUEUE;
+        activation_queue_size   = atoi(value + strlen("queue:"));
+        return activation_queue_size > 0;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+void apply_activation_policy(GDBusMessage *message)
+{
+    if (activation_policy != ACTIVATION_START) {
+        g_dbus_message_set_flags(message, g_dbus_message_get_flags(message) | G_DBUS_MESSAGE_FLAGS_NO_AUTO_START);
+    }
+}
+
+// Ask the broker to start a service and wait until it has acquired its name.
+// No more than activation_queue_size services are started at once, even with
+// multiple workers.
+//
+// Returns true if the service was started by this call.
+gboolean activate_service(GDBusConnection *bus, const gchar *name)
+{
+    GDBusMessage *request;
+    GDBusMessage *reply;
+    GError *error = NULL;
+    guint32 result = 0;
+
+    g_mutex_lock(&activation_lock);
+    while (activations >= activation_queue_size)
+        g_cond_wait(&activation_cond, &activation_lock);
+    activations++;
+    g_mutex_unlock(&activation_lock);
+
+    g_debug("activating %s", name);
+
+    request = g_dbus_method("org.freedesktop.DBus",
+                            "/org/freedesktop/DBus",
+                            "org.freedesktop.DBus",
+                            "StartServiceByName");
+
+    g_dbus_message_set_body(request, g_variant_new("(su)", name, 0));
+
+    // This deliberately bypasses the adaptive timeouts, the broker is
+    // usually quick but starting a service isn't.
+    if (trace_replay_file) {
+        reply = replay_message(request, &error);
+    } else {
+        reply = g_dbus_send(bus, request, G_DBUS_SEND_MESSAGE_FLAGS_NONE, ACTIVATION_TIMEOUT, NULL, NULL, &error);
+        record_message(request, reply, error);
+    }
+
+    if (reply == NULL) {
+        g_debug("failed to activate %s, %s", name, error->message);
+        g_error_free(error);
+    } else if (g_dbus_message_get_message_type(reply) == G_DBUS_MESSAGE_TYPE_METHOD_RETURN) {
+        g_variant_get(g_dbus_message_get_body(reply), "(u)", &result);
+    } else {
+        g_debug("failed to activate %s, %s", name, g_dbus_message_get_error_name(reply));
+    }
+
+    g_mutex_lock(&activation_lock);
+    activations--;
+    g_cond_signal(&activation_cond);
+    g_mutex_unlock(&activation_lock);
+
+    if (reply)
+        g_object_unref(reply);
+    g_object_unref(request);
+    return result == DBUS_START_REPLY_SUCCESS;
+}
+
+gboolean name_has_owner(GDBusConnection *bus, const gchar *name)
+{
+    GDBusMessage *request;
+    GVariant *reply;
+    gboolean result = false;
+
+    request = g_dbus_method("org.freedesktop.DBus",
+                            "/org/freedesktop/DBus",
+                            "org.freedesktop.DBus",
+                            "NameHasOwner");
+
+    g_dbus_message_set_body(request, g_variant_new("(s)", name));
+
+    if ((reply = g_dbus_simple_send(bus, request, "(b)"))) {
+        g_variant_get(reply, "(b)", &result);
+        g_variant_unref(reply);
+    }
+
+    return result;
+}
@@ -0,0 +1,21 @@
+#ifndef __ACTIVATION_H
+#define __ACTIVATION_H
+
+// What to do about names that are activatable but not running.
+typedef enum {
+    ACTIVATION_START,           // Let the first message start them.
+    ACTIVATION_SKIP,            // Don't scan them at all.
+    ACTIVATION_NO_AUTO_START,   // Scan them, but never start them.
+    ACTIVATION_QUEUE,           // Start them explicitly, a few at a time.
+} activation_policy_t;
+
+gboolean parse_activation_policy(const gchar *value);
+void apply_activation_policy(GDBusMessage *message);
+gboolean activate_service(GDBusConnection *bus, const gchar *name);
+gboolean name_has_owner(GDBusConnection *bus, const gchar *name);
+
+// Options
+extern activation_policy_t activation_policy;
+extern gint activation_queue_size;
+
+#endif
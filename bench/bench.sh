@@ -0,0 +1,102 @@
+#!/bin/sh
+#
+# Benchmark dbus-map against synthetic services on a private bus.
+#
+# Usage: bench/bench.sh [DBUS-MAP OPTIONS...]
+#
+# The services are configured with these environment variables:
+#
+#   BENCH_NAMES     Number of well-known names.
+#   BENCH_PATHS     Number of objects exported by each name.
+#   BENCH_MEMBERS   Number of methods and properties on each object.
+#   BENCH_LATENCY   Reply latency in milliseconds.
+#   BENCH_DENIED    Percentage of probes answered with AccessDenied.
+#
+# dbus-map is run three times, once for each phase of a scan:
+#
+#   map         List names, map them to processes and walk every object.
+#   dump        As above, but also parse and list methods and properties.
+#   probe       As above, but also probe every method and property.
+#
+# For each run, the wall clock time, number of calls the services received and
+# peak RSS of dbus-map are printed. The output of the last run is left in
+# bench_output.txt.
+
+set -e
+
+: ${BENCH_NAMES:=16}
+: ${BENCH_PATHS:=64}
+: ${BENCH_MEMBERS:=16}
+: ${BENCH_LATENCY:=0}
+: ${BENCH_DENIED:=50}
+: ${DBUS_DAEMON:=dbus-daemon}
+: ${DBUS_SEND:=dbus-send}
+
+bench=$(dirname "$0")
+tmpdir=$(mktemp -d)
+daemon=
+services=
+
+cleanup() {
+    test -z "$services" || kill $services 2>/dev/null || true
+    test -z "$daemon" || kill $daemon 2>/dev/null || true
+    rm -rf "$tmpdir"
+}
+
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+wait_for() {
+    tries=100
+    until eval "$1"; do
+        tries=$((tries - 1))
+        if test $tries -eq 0; then
+            echo "timed out waiting for $2" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+}
+
+# The number of calls received by the services so far, GetCallCount itself
+# is included.
+call_count() {
+    $DBUS_SEND --print-reply=literal --dest=org.dbusmap.Bench.Name0 / org.dbusmap.Bench.Control.GetCallCount | awk '{ print $2 }'
+}
+
+DBUS_SESSION_BUS_ADDRESS=unix:path=$tmpdir/bus
+export DBUS_SESSION_BUS_ADDRESS
+
+$DBUS_DAEMON --nofork --config-file="$bench/bus.conf" --address="$DBUS_SESSION_BUS_ADDRESS" &
+daemon=$!
+
+wait_for "test -S '$tmpdir/bus'" "dbus-daemon"
+
+"$bench/synthetic" --names="$BENCH_NAMES"           \
+                   --paths="$BENCH_PATHS"           \
+                   --members="$BENCH_MEMBERS"       \
+                   --latency="$BENCH_LATENCY"       \
+                   --denied="$BENCH_DENIED" > "$tmpdir/synthetic.log" &
+services=$!
+
+wait_for "grep -q ready '$tmpdir/synthetic.log'" "synthetic services"
+
+echo "names=$BENCH_NAMES paths=$BENCH_PATHS members=$BENCH_MEMBERS latency=${BENCH_LATENCY}ms denied=$BENCH_DENIED% options=$*"
+printf "%-8s %10s %10s %12s %12s\n" PHASE TIME CALLS CALLS/SEC "PEAK RSS"
+
+for phase in map dump probe; do
+    case $phase in
+        map)    flags= ;;
+        dump)   flags="--dump-methods --dump-properties" ;;
+        probe)  flags="--dump-methods --dump-properties --enable-probes" ;;
+    esac
+
+    before=$(call_count)
+    result=$("$bench/runner" bench_output.txt ./dbus-map --session $flags "$@")
+    after=$(call_count)
+
+    echo $result $before $after | awk -v phase=$phase '{
+        calls = $4 - $3 - 1
+        printf "%-8s %9.3fs %10d %12.0f %8d KiB\n", phase, $1, calls, ($1 > 0 ? calls / $1 : 0), $2
+    }'
+done
@@ -0,0 +1,57 @@
+#define _GNU_SOURCE
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Run a command with stdout redirected to a file, and print the elapsed time
+// in seconds and peak resident set size of the command in KiB.
+//
+// Usage: runner OUTPUT COMMAND [ARGS...]
+
+int main(int argc, char **argv)
+{
+    struct timespec start, end;
+    struct rusage usage;
+    pid_t child;
+    int status;
+    int fd;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s OUTPUT COMMAND [ARGS...]\n", argv[0]);
+        return 1;
+    }
+
+    if ((fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if ((child = fork()) == 0) {
+        dup2(fd, STDOUT_FILENO);
+        execvp(argv[2], &argv[2]);
+        perror(argv[2]);
+        _exit(127);
+    }
+
+    if (child < 0 || wait4(child, &status, 0, &usage) != child) {
+        perror("wait4");
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%.3f %ld\n", (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, usage.ru_maxrss);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed with status %#x\n", argv[2], status);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,342 @@
+#define _GNU_SOURCE
+#include <gio/gio.h>
+#include <glib-unix.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Synthetic services for benchmarking dbus-map.
+//
+// Each name is a separate connection to the bus, exporting a flat tree of
+// objects under /org/dbusmap/Bench. Every object implements one interface
+// with the same methods and properties.
+//
+// All method calls are answered from a filter function rather than a
+// registered object, because GDBus would otherwise reject calls with the wrong
+// signature itself, and dbus-map probes never use the right signature. Calls
+// are answered with AccessDenied or InvalidArgs at random, so that the
+// proportion of members dbus-map reports can be controlled.
+
+#define BENCH_ROOT      "/org/dbusmap/Bench"
+#define BENCH_INTERFACE "org.dbusmap.Bench.Object"
+#define BENCH_CONTROL   "org.dbusmap.Bench.Control"
+
+static gint bench_names = 4;
+static gint bench_paths = 16;
+static gint bench_members = 8;
+static gint bench_latency;
+static gint bench_denied = 50;
+
+static GOptionEntry entries[] = {
+    { "names", 0, 0, G_OPTION_ARG_INT, &bench_names, "Number of well-known names to own", "N" },
+    { "paths", 0, 0, G_OPTION_ARG_INT, &bench_paths, "Number of objects exported by each name", "M" },
+    { "members", 0, 0, G_OPTION_ARG_INT, &bench_members, "Number of methods and properties on each object", "K" },
+    { "latency", 0, 0, G_OPTION_ARG_INT, &bench_latency, "Delay every reply by MS milliseconds", "MS" },
+    { "denied", 0, 0, G_OPTION_ARG_INT, &bench_denied, "Percentage of probes answered with AccessDenied, the rest get InvalidArgs", "PERCENT" },
+    { NULL },
+};
+
+// Number of method calls received, reported by GetCallCount.
+static volatile gint call_count;
+
+// The introspection data for an object, it's the same for all of them.
+static gchar *object_xml;
+
+typedef struct {
+    GDBusConnection *bus;
+    GDBusMessage    *reply;
+} pending_reply_t;
+
+static gchar * build_object_xml(void)
+{
+    GString *xml = g_string_new("<node>\n");
+
+    g_string_append(xml, "  <interface name='org.freedesktop.DBus.Introspectable'>\n"
+                         "    <method name='Introspect'><arg type='s' direction='out'/></method>\n"
+                         "  </interface>\n"
+                         "  <interface name='org.freedesktop.DBus.Properties'>\n"
+                         "    <method name='Get'><arg type='s'/><arg type='s'/><arg type='v' direction='out'/></method>\n"
+                         "    <method name='GetAll'><arg type='s'/><arg type='a{sv}' direction='out'/></method>\n"
+                         "    <method name='Set'><arg type='s'/><arg type='s'/><arg type='v'/></method>\n"
+                         "  </interface>\n");
+
+    g_string_append(xml, "  <interface name='" BENCH_INTERFACE "'>\n");
+
+    for (gint i = 0; i < bench_members; i++) {
+        g_string_append_printf(xml, "    <method name='Method%d'><arg type='s'/><arg type='u'/><arg type='s' direction='out'/></method>\n", i);
+    }
+
+    for (gint i = 0; i < bench_members; i++) {
+        g_string_append_printf(xml, "    <property name='Property%d' type='s' access='readwrite'/>\n", i);
+    }
+
+    g_string_append(xml, "  </interface>\n</node>\n");
+
+    return g_string_free(xml, false);
+}
+
+// Introspection data for a path, or NULL if there's no object there.
+static gchar * get_path_xml(const gchar *path)
+{
+    gsize length = strlen(path);
+    const gchar *child;
+    gint index;
+    gint end = 0;
+
+    // The parent of all the objects.
+    if (g_strcmp0(path, BENCH_ROOT) == 0) {
+        GString *xml = g_string_new("<node>\n");
+        for (gint i = 0; i < bench_paths; i++) {
+            g_string_append_printf(xml, "  <node name='Object%d'/>\n", i);
+        }
+        g_string_append(xml, "</node>\n");
+        return g_string_free(xml, false);
+    }
+
+    // One of the objects.
+    if (sscanf(path, BENCH_ROOT "/Object%d%n", &index, &end) == 1 && path[end] == '\0' && index >= 0 && index < bench_paths) {
+        return g_strdup(object_xml);
+    }
+
+    // An ancestor of BENCH_ROOT, which just has one child.
+    if (g_strcmp0(path, "/") == 0) {
+        length = 0;
+    } else if (!g_str_has_prefix(BENCH_ROOT, path) || BENCH_ROOT[length] != '/') {
+        return NULL;
+    }
+
+    child = BENCH_ROOT + length + 1;
+
+    return g_strdup_printf("<node>\n  <node name='%.*s'/>\n</node>\n", (gint) strcspn(child, "/"), child);
+}
+
+static GVariant * get_all_values(void)
+{
+    GVariantBuilder builder;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+
+    for (gint i = 0; i < bench_members; i++) {
+        gchar *name = g_strdup_printf("Property%d", i);
+        g_variant_builder_add(&builder, "{sv}", name, g_variant_new_string("value"));
+        g_free(name);
+    }
+
+    return g_variant_builder_end(&builder);
+}
+
+// Answer a probe, either AccessDenied or InvalidArgs.
+static GDBusMessage * build_probe_reply(GDBusMessage *message)
+{
+    if (g_random_int_range(0, 100) < bench_denied) {
+        return g_dbus_message_new_method_error(message, "org.freedesktop.DBus.Error.AccessDenied", "Access denied");
+    }
+
+    return g_dbus_message_new_method_error(message, "org.freedesktop.DBus.Error.InvalidArgs", "Invalid arguments");
+}
+
+static GDBusMessage * build_reply(GDBusMessage *message)
+{
+    const gchar  *interface = g_dbus_message_get_interface(message);
+    const gchar  *member = g_dbus_message_get_member(message);
+    const gchar  *path = g_dbus_message_get_path(message);
+    GDBusMessage *reply;
+    gchar        *xml;
+
+    if (g_strcmp0(interface, BENCH_CONTROL) == 0 && g_strcmp0(member, "GetCallCount") == 0) {
+        reply = g_dbus_message_new_method_reply(message);
+        g_dbus_message_set_body(reply, g_variant_new("(u)", g_atomic_int_get(&call_count)));
+        return reply;
+    }
+
+    if (g_strcmp0(interface, "org.freedesktop.DBus.Peer") == 0 && g_strcmp0(member, "Ping") == 0) {
+        return g_dbus_message_new_method_reply(message);
+    }
+
+    if (!(xml = get_path_xml(path))) {
+        return g_dbus_message_new_method_error(message, "org.freedesktop.DBus.Error.UnknownObject", "No such object %s", path);
+    }
+
+    if (g_strcmp0(interface, "org.freedesktop.DBus.Introspectable") == 0 && g_strcmp0(member, "Introspect") == 0) {
+        reply = g_dbus_message_new_method_reply(message);
+        g_dbus_message_set_body(reply, g_variant_new("(s)", xml));
+        g_free(xml);
+        return reply;
+    }
+
+    g_free(xml);
+
+    // Only the objects themselves implement anything else.
+    if (!g_str_has_prefix(path, BENCH_ROOT "/")) {
+        return g_dbus_message_new_method_error(message, "org.freedesktop.DBus.Error.UnknownInterface", "No such interface %s", interface);
+    }
+
+    if (g_strcmp0(interface, "org.freedesktop.DBus.Properties") == 0) {
+        if (g_strcmp0(member, "Get") == 0) {
+            reply = g_dbus_message_new_method_reply(message);
+            g_dbus_message_set_body(reply, g_variant_new("(v)", g_variant_new_string("value")));
+            return reply;
+        }
+        if (g_strcmp0(member, "GetAll") == 0) {
+            reply = g_dbus_message_new_method_reply(message);
+            g_dbus_message_set_body(reply, g_variant_new("(@a{sv})", get_all_values()));
+            return reply;
+        }
+        if (g_strcmp0(member, "Set") == 0) {
+            return build_probe_reply(message);
+        }
+    }
+
+    if (g_strcmp0(interface, BENCH_INTERFACE) == 0 && g_str_has_prefix(member, "Method")) {
+        return build_probe_reply(message);
+    }
+
+    return g_dbus_message_new_method_error(message, "org.freedesktop.DBus.Error.UnknownMethod", "No such method %s", member);
+}
+
+static gboolean send_pending_reply(gpointer user_data)
+{
+    pending_reply_t *pending = user_data;
+
+    g_dbus_connection_send_message(pending->bus, pending->reply, G_DBUS_SEND_MESSAGE_FLAGS_NONE, NULL, NULL);
+    g_object_unref(pending->reply);
+    g_object_unref(pending->bus);
+    g_free(pending);
+    return G_SOURCE_REMOVE;
+}
+
+// Runs on the GDBus worker thread, so replies are either sent immediately or
+// handed to the main loop to send after the configured latency.
+static GDBusMessage * handle_message(GDBusConnection *bus,
+                                     GDBusMessage *message,
+                                     gboolean incoming,
+                                     G_GNUC_UNUSED gpointer user_data)
+{
+    pending_reply_t *pending;
+
+    if (!incoming || g_dbus_message_get_message_type(message) != G_DBUS_MESSAGE_TYPE_METHOD_CALL)
+        return message;
+
+    g_atomic_int_inc(&call_count);
+
+    pending         = g_new0(pending_reply_t, 1);
+    pending->bus    = g_object_ref(bus);
+    pending->reply  = build_reply(message);
+
+    if (bench_latency > 0) {
+        g_timeout_add(bench_latency, send_pending_reply, pending);
+    } else {
+        send_pending_reply(pending);
+    }
+
+    g_object_unref(message);
+    return NULL;
+}
+
+static gboolean handle_signal(gpointer user_data)
+{
+    g_main_loop_quit(user_data);
+    return G_SOURCE_REMOVE;
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext  *context;
+    GMainLoop       *loop;
+    GPtrArray       *connections;
+    GError          *error = NULL;
+    gchar           *address;
+
+    context = g_option_context_new("- synthetic services for benchmarking dbus-map");
+
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_print("option parsing failed: %s\n", error->message);
+        return 1;
+    }
+
+    g_option_context_free(context);
+
+    if (bench_names < 1 || bench_paths < 0 || bench_members < 0 || bench_denied < 0 || bench_denied > 100) {
+        g_print("invalid benchmark parameters\n");
+        return 1;
+    }
+
+    if (!(address = g_dbus_address_get_for_bus_sync(G_BUS_TYPE_SESSION, NULL, &error))) {
+        g_print("no session bus address: %s\n", error->message);
+        return 1;
+    }
+
+    object_xml  = build_object_xml();
+    loop        = g_main_loop_new(NULL, false);
+    connections = g_ptr_array_new_with_free_func(g_object_unref);
+
+    for (gint i = 0; i < bench_names; i++) {
+        GDBusConnection *bus;
+        GVariant        *result;
+        gchar           *name = g_strdup_printf("org.dbusmap.Bench.Name%d", i);
+        guint            reply;
+
+        bus = g_dbus_connection_new_for_address_sync(address,
+                                                     G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT
+                                                   | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                     NULL,
+                                                     NULL,
+                                                     &error);
+
+        if (!bus) {
+            g_print("failed to connect to %s: %s\n", address, error->message);
+            return 1;
+        }
+
+        g_dbus_connection_add_filter(bus, handle_message, NULL, NULL);
+
+        // DBUS_NAME_FLAG_DO_NOT_QUEUE
+        result = g_dbus_connection_call_sync(bus,
+                                             "org.freedesktop.DBus",
+                                             "/org/freedesktop/DBus",
+                                             "org.freedesktop.DBus",
+                                             "RequestName",
+                                             g_variant_new("(su)", name, 4),
+                                             G_VARIANT_TYPE("(u)"),
+                                             G_DBUS_CALL_FLAGS_NONE,
+                                             -1,
+                                             NULL,
+                                             &error);
+
+        if (!result) {
+            g_print("failed to request %s: %s\n", name, error->message);
+            return 1;
+        }
+
+        g_variant_get(result, "(u)", &reply);
+        g_variant_unref(result);
+
+        // DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER
+        if (reply != 1) {
+            g_print("failed to own %s\n", name);
+            return 1;
+        }
+
+        g_ptr_array_add(connections, bus);
+        g_free(name);
+    }
+
+    // The benchmark script waits for this.
+    g_print("ready\n");
+    fflush(stdout);
+
+    g_unix_signal_add(SIGINT, handle_signal, loop);
+    g_unix_signal_add(SIGTERM, handle_signal, loop);
+
+    g_main_loop_run(loop);
+
+    g_ptr_array_free(connections, true);
+    g_main_loop_unref(loop);
+    g_free(object_xml);
+    g_free(address);
+    return 0;
+}
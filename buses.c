@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+#include <gio/gio.h>
+#include <glob.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "buses.h"
+
+// With --address, any number of buses can be scanned in one run, e.g. every
+// per-user session bus and the buses of some containers:
+//
+//  system          The system bus.
+//  session         The session bus of dbus-map.
+//  unix:path=...   Any D-Bus address, used as is.
+//  /run/user/*/bus A path to a bus socket, glob patterns are expanded.
+//
+// Each bus is scanned by its own thread over its own connections, and results
+// are tagged with the label of the bus they came from.
+
+// Options
+gchar **scan_addresses;
+
+static bus_address_t * new_bus_address(const gchar *label, gchar *address, GBusType type)
+{
+    bus_address_t *target = g_new0(bus_address_t, 1);
+
+    target->label   = g_strdup(label);
+    target->address = address;
+    target->type    = type;
+
+    return target;
+}
+
+void free_bus_address(bus_address_t *target)
+{
+    g_free(target->label);
+    g_free(target->address);
+    g_free(target);
+}
+
+// Add every socket that matches pattern.
+static void expand_bus_pattern(GPtrArray *targets, const gchar *pattern)
+{
+    glob_t matches = {0};
+    guint found = 0;
+
+    // Matches are sorted, so the order of results doesn't depend on the
+    // filesystem.
+    if (glob(pattern, 0, NULL, &matches) != 0) {
+        g_warning("no bus sockets match %s", pattern);
+        globfree(&matches);
+        return;
+    }
+
+    for (gsize i = 0; i < matches.gl_pathc; i++) {
+        const gchar *path = matches.gl_pathv[i];
+        struct stat info;
+        gchar *escaped;
+
+        if (stat(path, &info) != 0 || !S_ISSOCK(info.st_mode)) {
+            g_debug("skipping %s, not a socket", path);
+            continue;
+        }
+
+        escaped = g_dbus_address_escape_value(path);
+
+        g_ptr_array_add(targets, new_bus_address(path, g_strdup_printf("unix:path=%s", escaped), G_BUS_TYPE_NONE));
+        g_free(escaped);
+        found++;
+    }
+
+    if (found == 0) {
+        g_warning("no bus sockets match %s", pattern);
+    }
+
+    globfree(&matches);
+}
+
+// Resolve a list of --address values into buses to scan, in the order given.
+// Duplicates are removed, so /run/user/*/bus can be combined with session.
+//
+// Returns an array of bus_address_t, or NULL if any value was invalid.
+GPtrArray * expand_bus_addresses(gchar **specs)
+{
+    GPtrArray *targets = g_ptr_array_new_with_free_func((GDestroyNotify) free_bus_address);
+    GError *error = NULL;
+
+    for (gchar **spec = specs; spec && *spec; spec++) {
+        GBusType type = G_BUS_TYPE_NONE;
+        gchar *address;
+
+        if (g_strcmp0(*spec, "system") == 0) {
+            type = G_BUS_TYPE_SYSTEM;
+        } else if (g_strcmp0(*spec, "session") == 0) {
+            type = G_BUS_TYPE_SESSION;
+        } else if (g_dbus_is_address(*spec)) {
+            g_ptr_array_add(targets, new_bus_address(*spec, g_strdup(*spec), G_BUS_TYPE_NONE));
+            continue;
+        } else if (**spec == '/') {
+            expand_bus_pattern(targets, *spec);
+            continue;
+        } else {
+            g_message("%s is not a bus, address or socket path", *spec);
+            g_ptr_array_unref(targets);
+            return NULL;
+        }
+
+        if (!(address = g_dbus_address_get_for_bus_sync(type, NULL, &error))) {
+            g_message("failed to find %s bus address, %s", *spec, error->message);
+            g_clear_error(&error);
+            continue;
+        }
+
+        g_ptr_array_add(targets, new_bus_address(*spec, address, type));
+    }
+
+    // The first occurrence of each address wins.
+    for (guint i = 1; i < targets->len; i++) {
+        bus_address_t *target = g_ptr_array_index(targets, i);
+
+        for (guint j = 0; j < i; j++) {
+            bus_address_t *first = g_ptr_array_index(targets, j);
+
+            if (g_strcmp0(target->address, first->address) == 0) {
+                g_debug("%s is the same bus as %s", target->label, first->label);
+                g_ptr_array_remove_index(targets, i--);
+                break;
+            }
+        }
+    }
+
+    return targets;
+}
+
+// Connect to a bus. The system and session buses use the shared GDBus
+// connection, like the rest of dbus-map, other addresses get a new one.
+//
+// Returns NULL on error, or a connection you should free with g_object_unref().
+GDBusConnection * open_bus_address(bus_address_t *target, GError **error)
+{
+    if (target->type != G_BUS_TYPE_NONE) {
+        return g_bus_get_sync(target->type, NULL, error);
+    }
+
+    return g_dbus_connection_new_for_address_sync(target->address,
+                                                  G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT
+                                                | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                  NULL,
+                                                  NULL,
+                                                  error);
+}
@@ -0,0 +1,18 @@
+#ifndef __BUSES_H
+#define __BUSES_H
+
+// A bus to scan, see expand_bus_addresses().
+typedef struct {
+    gchar       *label;     // Tags results from this bus, e.g. /run/user/1000/bus.
+    gchar       *address;
+    GBusType     type;      // G_BUS_TYPE_NONE, unless this is the system or session bus.
+} bus_address_t;
+
+GPtrArray * expand_bus_addresses(gchar **specs);
+GDBusConnection * open_bus_address(bus_address_t *target, GError **error);
+void free_bus_address(bus_address_t *target);
+
+// Options
+extern gchar **scan_addresses;
+
+#endif
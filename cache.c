@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+#include <gio/gio.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "cache.h"
+
+// Introspection data rarely changes unless the service is restarted or
+// upgraded, so it can be kept between runs. Each well-known name has a cache
+// file containing a fingerprint of the owning process and the XML for every
+// object path visited. If the fingerprint doesn't match the current owner,
+// the whole file is discarded. With --address, the same name can be on
+// several buses, so the file name includes the bus label too.
+//
+// The file is a serialized GVariant of type (sa{ss}), which is mapped and
+// used in place rather than parsed.
+
+#define CACHE_FILE_TYPE "(sa{ss})"
+
+// Options
+gchar *introspect_cache_dir;
+
+struct _introspect_cache {
+    gchar       *filename;
+    gchar       *fingerprint;
+    GVariant    *stored;    // Contents of the cache file, if valid.
+    GHashTable  *lookup;    // path -> xml, pointing into stored.
+    GHashTable  *entries;   // path -> xml, to be written back.
+    gboolean     dirty;
+};
+
+static GVariant * load_cache_file(const gchar *filename)
+{
+    GMappedFile *file;
+    GVariant *result;
+    GBytes *bytes;
+
+    if (!(file = g_mapped_file_new(filename, false, NULL))) {
+        return NULL;
+    }
+
+    bytes  = g_mapped_file_get_bytes(file);
+    result = g_variant_new_from_bytes(G_VARIANT_TYPE(CACHE_FILE_TYPE), bytes, false);
+
+    g_bytes_unref(bytes);
+    g_mapped_file_unref(file);
+    return g_variant_ref_sink(result);
+}
+
+// Open the cache for a name on the bus with the specified label (see scan_t),
+// currently owned by a process with the specified fingerprint. Unique names
+// are never cached, they're different every time.
+//
+// Returns NULL if caching is disabled, or a pointer to be freed with
+// close_introspect_cache(). All functions accept a NULL cache.
+introspect_cache_t * open_introspect_cache(const gchar *label, const gchar *name, const gchar *fingerprint)
+{
+    introspect_cache_t *cache;
+    GVariantIter iter;
+    GVariant *paths;
+    const gchar *stored;
+    const gchar *path;
+    const gchar *xml;
+    gchar *escaped;
+
+    if (introspect_cache_dir == NULL || fingerprint == NULL || *name == ':') {
+        return NULL;
+    }
+
+    cache               = g_new0(introspect_cache_t, 1);
+
+    // Labels are paths or addresses, so they're escaped to stay in one file name.
+    if (label) {
+        escaped         = g_uri_escape_string(label, NULL, false);
+        cache->filename = g_strdup_printf("%s/%s@%s.introspect", introspect_cache_dir, name, escaped);
+        g_free(escaped);
+    } else {
+        cache->filename = g_strdup_printf("%s/%s.introspect", introspect_cache_dir, name);
+    }
+
+    cache->fingerprint  = g_strdup(fingerprint);
+    cache->lookup       = g_hash_table_new(g_str_hash, g_str_equal);
+    cache->entries      = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+    if (!(cache->stored = load_cache_file(cache->filename))) {
+        g_debug("no introspection cache for %s", name);
+        return cache;
+    }
+
+    g_variant_get_child(cache->stored, 0, "&s", &stored);
+
+    if (g_strcmp0(stored, fingerprint) != 0) {
+        g_debug("introspection cache for %s is stale, %s != %s", name, stored, fingerprint);
+        g_clear_pointer(&cache->stored, g_variant_unref);
+        return cache;
+    }
+
+    // The strings point into the mapped file, which stays valid while stored is alive.
+    paths = g_variant_get_child_value(cache->stored, 1);
+
+    g_variant_iter_init(&iter, paths);
+
+    while (g_variant_iter_next(&iter, "{&s&s}", &path, &xml)) {
+        g_hash_table_insert(cache->lookup, (gpointer) path, (gpointer) xml);
+    }
+
+    g_variant_unref(paths);
+
+    g_debug("loaded %u cached paths for %s", g_hash_table_size(cache->lookup), name);
+    return cache;
+}
+
+// Returns NULL, or a pointer you should free with g_free().
+gchar * lookup_introspect_cache(introspect_cache_t *cache, const gchar *path)
+{
+    const gchar *xml;
+
+    if (cache == NULL || !(xml = g_hash_table_lookup(cache->lookup, path))) {
+        return NULL;
+    }
+
+    // Remember that we used this, so that it's written back.
+    g_hash_table_replace(cache->entries, g_strdup(path), g_strdup(xml));
+    return g_strdup(xml);
+}
+
+void update_introspect_cache(introspect_cache_t *cache, const gchar *path, const gchar *xml)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    g_hash_table_replace(cache->entries, g_strdup(path), g_strdup(xml));
+    cache->dirty = true;
+}
+
+static void save_cache_file(introspect_cache_t *cache)
+{
+    GVariantBuilder builder;
+    GHashTableIter iter;
+    GVariant *contents;
+    GError *error = NULL;
+    gpointer path;
+    gpointer xml;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{ss}"));
+    g_hash_table_iter_init(&iter, cache->entries);
+
+    while (g_hash_table_iter_next(&iter, &path, &xml)) {
+        g_variant_builder_add(&builder, "{ss}", path, xml);
+    }
+
+    contents = g_variant_ref_sink(g_variant_new("(sa{ss})", cache->fingerprint, &builder));
+
+    if (g_mkdir_with_parents(introspect_cache_dir, 0700) != 0
+     || !g_file_set_contents(cache->filename, g_variant_get_data(contents), g_variant_get_size(contents), &error)) {
+        g_warning("failed to write introspection cache %s, %s", cache->filename, error ? error->message : "mkdir failed");
+        g_clear_error(&error);
+    }
+
+    g_variant_unref(contents);
+}
+
+void close_introspect_cache(introspect_cache_t *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    if (cache->dirty) {
+        save_cache_file(cache);
+    }
+
+    if (cache->stored)
+        g_variant_unref(cache->stored);
+
+    g_hash_table_destroy(cache->lookup);
+    g_hash_table_destroy(cache->entries);
+    g_free(cache->fingerprint);
+    g_free(cache->filename);
+    g_free(cache);
+}
@@ -0,0 +1,14 @@
+#ifndef __CACHE_H
+#define __CACHE_H
+
+typedef struct _introspect_cache introspect_cache_t;
+
+introspect_cache_t * open_introspect_cache(const gchar *label, const gchar *name, const gchar *fingerprint);
+gchar * lookup_introspect_cache(introspect_cache_t *cache, const gchar *path);
+void update_introspect_cache(introspect_cache_t *cache, const gchar *path, const gchar *xml);
+void close_introspect_cache(introspect_cache_t *cache);
+
+// Options
+extern gchar *introspect_cache_dir;
+
+#endif
@@ -0,0 +1,452 @@
+#define _GNU_SOURCE
+#include <gio/gio.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "probes.h"
+#include "classify.h"
+
+// Probes decide whether we have access from the error name a service replies
+// with. Services use all sorts of vendor-specific errors, so rather than
+// hard-coding them, the decision is made by a table of rules, one per line:
+//
+//  # context   match       pattern                             verdict
+//  method      exact       org.freedesktop.DBus.Error.InvalidArgs allowed
+//  method      contains    PolKit.NotAuthorizedException       denied
+//
+// Context is method, property or name (for RequestName probes, where denied
+// means the name is protected). Rules from --error-rules are consulted before
+// the built-in rules below, and the first matching rule wins, whether it's an
+// exact or a substring match.
+//
+// Each context is compiled into a hash table of exact names keyed by quark,
+// so an error that has never been seen doesn't even need hashing, and an
+// Aho-Corasick automaton that finds every substring rule in a single pass
+// over the error name.
+
+static const gchar builtin_rules[] =
+    "method     exact       org.freedesktop.DBus.Python.ValueError                      allowed\n"
+    "method     exact       org.freedesktop.DBus.Error.InvalidArgs                      allowed\n"
+    "method     exact       org.freedesktop.DBus.Python.TypeError                       allowed\n"
+    "method     exact       org.freedesktop.DBus.Python.dbus.exceptions.DBusException   allowed\n"
+    "method     exact       org.freedesktop.DBus.Error.UnknownMethod                    denied\n"
+    "method     exact       org.freedesktop.DBus.Error.AccessDenied                     denied\n"
+    "method     exact       org.freedesktop.PolicyKit.Error.NotAuthorized               denied\n"
+    "method     contains    PolKit.NotAuthorizedException                               denied\n"
+    "method     contains    authorization_2derror                                       denied\n"
+    "property   exact       org.freedesktop.DBus.Error.InvalidArgs                      allowed\n"
+    "property   exact       org.freedesktop.DBus.Error.NoReply                          allowed\n"
+    "property   exact       org.freedesktop.DBus.Error.AccessDenied                     denied\n"
+    "property   exact       org.freedesktop.DBus.Error.PropertyReadOnly                 denied\n"
+    "property   exact       org.freedesktop.PolicyKit.Error.NotAuthorized               denied\n"
+    "property   exact       org.freedesktop.DBus.Python.dbus.exceptions.DBusException   denied\n"
+    "property   exact       org.freedesktop.DBus.Error.UnknownMethod                    denied\n"
+    "property   exact       org.freedesktop.DBus.Error.ServiceUnknown                   denied\n"
+    "property   contains    authorization_2derror                                       denied\n"
+    "name       exact       org.freedesktop.DBus.Error.AccessDenied                     denied\n"
+    "name       exact       org.freedesktop.DBus.Error.InvalidArgs                      denied\n";
+
+// Error names are ASCII, anything else can't match a pattern.
+#define AUTOMATON_ALPHABET 128
+
+// Options
+gchar *error_rules_file;
+gboolean enable_error_report;
+
+typedef struct {
+    error_context_t context;
+    gboolean        substring;
+    const gchar    *pattern;
+    verdict_t       verdict;
+    volatile gint   hits;
+} rule_t;
+
+typedef struct {
+    guint32     next[AUTOMATON_ALPHABET];
+    guint32     fail;
+    guint32     match;          // Lowest matching rule + 1, including suffixes.
+} state_t;
+
+typedef struct {
+    GHashTable  *exact;         // GQuark -> rule + 1
+    GArray      *states;        // state_t, state 0 is the root.
+} classifier_t;
+
+typedef struct {
+    error_context_t context;
+    gchar          *error;
+    gchar          *example;    // A service that replied with it.
+    guint           count;
+} unknown_error_t;
+
+static const gchar * context_names[] = {
+    [ERROR_CONTEXT_METHOD]      = "method",
+    [ERROR_CONTEXT_PROPERTY]    = "property",
+    [ERROR_CONTEXT_NAME]        = "name",
+};
+
+static GArray *rules;
+static GStringChunk *rule_strings;
+static classifier_t classifiers[ERROR_CONTEXT_MAX];
+static GHashTable *unknown_errors;
+static GMutex unknown_lock;
+
+static gboolean parse_error_context(const gchar *str, error_context_t *context)
+{
+    for (guint i = 0; i < ERROR_CONTEXT_MAX; i++) {
+        if (g_strcmp0(str, context_names[i]) == 0) {
+            *context = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static gboolean parse_verdict(const gchar *str, verdict_t *verdict)
+{
+    for (guint i = 0; i < VERDICT_MAX; i++) {
+        if (g_strcmp0(str, verdict_to_str(i)) == 0) {
+            *verdict = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static gboolean is_valid_pattern(const gchar *pattern)
+{
+    for (const gchar *p = pattern; *p; p++) {
+        if (*p <= ' ' || *p >= AUTOMATON_ALPHABET - 1) {
+            return false;
+        }
+    }
+    return *pattern != '\0';
+}
+
+// Parse rules and append them to the table, source is used in messages.
+static gboolean parse_error_rules(const gchar *contents, const gchar *source)
+{
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    gboolean result = true;
+
+    for (guint i = 0; lines[i]; i++) {
+        gchar **tokens;
+        gchar *fields[4];
+        guint count = 0;
+        rule_t rule = {0};
+
+        if (strchr(lines[i], '#')) {
+            *strchr(lines[i], '#') = '\0';
+        }
+
+        tokens = g_strsplit_set(lines[i], " \t\r", -1);
+
+        for (guint j = 0; tokens[j]; j++) {
+            if (*tokens[j] == '\0')
+                continue;
+            if (count < G_N_ELEMENTS(fields))
+                fields[count] = tokens[j];
+            count++;
+        }
+
+        if (count == 0) {
+            g_strfreev(tokens);
+            continue;
+        }
+
+        if (count != 4
+         || !parse_error_context(fields[0], &rule.context)
+         || (g_strcmp0(fields[1], "exact") != 0 && g_strcmp0(fields[1], "contains") != 0)
+         || !is_valid_pattern(fields[2])
+         || !parse_verdict(fields[3], &rule.verdict)) {
+            g_warning("%s:%u: expected CONTEXT exact|contains PATTERN VERDICT", source, i + 1);
+            g_strfreev(tokens);
+            result = false;
+            continue;
+        }
+
+        rule.substring  = g_strcmp0(fields[1], "contains") == 0;
+        rule.pattern    = g_string_chunk_insert_const(rule_strings, fields[2]);
+
+        g_array_append_val(rules, rule);
+        g_strfreev(tokens);
+    }
+
+    g_strfreev(lines);
+    return result;
+}
+
+static guint32 add_automaton_state(GArray *states)
+{
+    state_t state = {0};
+    g_array_append_val(states, state);
+    return states->len - 1;
+}
+
+static void add_automaton_pattern(GArray *states, const gchar *pattern, guint rule)
+{
+    guint32 current = 0;
+
+    for (const guchar *p = (const guchar *) pattern; *p; p++) {
+        guint32 next = g_array_index(states, state_t, current).next[*p];
+
+        // The root is never a transition target while building the trie.
+        if (next == 0) {
+            next = add_automaton_state(states);
+            g_array_index(states, state_t, current).next[*p] = next;
+        }
+
+        current = next;
+    }
+
+    if (g_array_index(states, state_t, current).match == 0) {
+        g_array_index(states, state_t, current).match = rule + 1;
+    }
+}
+
+// Turn the trie into a DFA, so that matching never follows failure links.
+static void build_automaton_links(GArray *states)
+{
+    GQueue queue = G_QUEUE_INIT;
+
+    for (guint c = 0; c < AUTOMATON_ALPHABET; c++) {
+        guint32 child = g_array_index(states, state_t, 0).next[c];
+
+        if (child) {
+            g_array_index(states, state_t, child).fail = 0;
+            g_queue_push_tail(&queue, GUINT_TO_POINTER(child));
+        }
+    }
+
+    while (!g_queue_is_empty(&queue)) {
+        guint32 current = GPOINTER_TO_UINT(g_queue_pop_head(&queue));
+        state_t *state = &g_array_index(states, state_t, current);
+        state_t *fail = &g_array_index(states, state_t, state->fail);
+
+        for (guint c = 0; c < AUTOMATON_ALPHABET; c++) {
+            guint32 child = state->next[c];
+
+            if (child == 0) {
+                state->next[c] = fail->next[c];
+                continue;
+            }
+
+            state_t *target = &g_array_index(states, state_t, child);
+
+            target->fail = fail->next[c];
+
+            // A match on a suffix is also a match here, keep the first rule.
+            if (g_array_index(states, state_t, target->fail).match) {
+                guint32 suffix = g_array_index(states, state_t, target->fail).match;
+                target->match = target->match ? MIN(target->match, suffix) : suffix;
+            }
+
+            g_queue_push_tail(&queue, GUINT_TO_POINTER(child));
+        }
+    }
+}
+
+static void compile_error_rules(void)
+{
+    for (guint i = 0; i < ERROR_CONTEXT_MAX; i++) {
+        classifiers[i].exact    = g_hash_table_new(g_direct_hash, g_direct_equal);
+        classifiers[i].states   = g_array_new(false, false, sizeof(state_t));
+        add_automaton_state(classifiers[i].states);
+    }
+
+    for (guint i = 0; i < rules->len; i++) {
+        rule_t *rule = &g_array_index(rules, rule_t, i);
+        classifier_t *classifier = &classifiers[rule->context];
+
+        if (rule->substring) {
+            add_automaton_pattern(classifier->states, rule->pattern, i);
+        } else {
+            gpointer quark = GUINT_TO_POINTER(g_quark_from_string(rule->pattern));
+
+            if (!g_hash_table_contains(classifier->exact, quark)) {
+                g_hash_table_insert(classifier->exact, quark, GUINT_TO_POINTER(i + 1));
+            }
+        }
+    }
+
+    for (guint i = 0; i < ERROR_CONTEXT_MAX; i++) {
+        build_automaton_links(classifiers[i].states);
+    }
+}
+
+// Load the rules from filename, if not NULL, followed by the built-in rules.
+// Must be called before classify_error().
+gboolean load_error_rules(const gchar *filename)
+{
+    GError *error = NULL;
+    gchar *contents;
+    gboolean result = true;
+
+    rules        = g_array_new(false, false, sizeof(rule_t));
+    rule_strings = g_string_chunk_new(1024);
+
+    if (filename) {
+        if (!g_file_get_contents(filename, &contents, NULL, &error)) {
+            g_warning("failed to read error rules %s, %s", filename, error->message);
+            g_error_free(error);
+            return false;
+        }
+
+        result = parse_error_rules(contents, filename);
+        g_free(contents);
+    }
+
+    parse_error_rules(builtin_rules, "built-in");
+    compile_error_rules();
+
+    g_debug("compiled %u error rules", rules->len);
+    return result;
+}
+
+static void record_unknown_error(error_context_t context, const gchar *error, const gchar *dest)
+{
+    unknown_error_t *unknown;
+    gchar *key;
+
+    if (!enable_error_report) {
+        return;
+    }
+
+    key = g_strdup_printf("%s %s", context_names[context], error);
+
+    g_mutex_lock(&unknown_lock);
+
+    if (unknown_errors == NULL) {
+        unknown_errors = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+
+    if ((unknown = g_hash_table_lookup(unknown_errors, key))) {
+        g_free(key);
+    } else {
+        unknown             = g_new0(unknown_error_t, 1);
+        unknown->context    = context;
+        unknown->error      = g_strdup(error);
+        unknown->example    = g_strdup(dest);
+        g_hash_table_insert(unknown_errors, key, unknown);
+    }
+
+    unknown->count++;
+
+    g_mutex_unlock(&unknown_lock);
+}
+
+// Decide what an error reply from dest means.
+//
+// Returns VERDICT_UNKNOWN if no rule matches.
+verdict_t classify_error(error_context_t context, const gchar *error, const gchar *dest)
+{
+    classifier_t *classifier;
+    guint32 state = 0;
+    guint32 match = 0;
+    guint32 found;
+    guint32 best = 0;
+    GQuark quark;
+    rule_t *rule;
+
+    g_return_val_if_fail(rules != NULL && context < ERROR_CONTEXT_MAX, VERDICT_UNKNOWN);
+
+    classifier = &classifiers[context];
+
+    // Only errors named by an exact rule have a quark, so this doesn't
+    // allocate for errors we've never heard of.
+    if ((quark = g_quark_try_string(error))) {
+        match = GPOINTER_TO_UINT(g_hash_table_lookup(classifier->exact, GUINT_TO_POINTER(quark)));
+    }
+
+    // The first substring rule that matches anywhere, which only matters if
+    // it comes before the exact rule.
+    for (const guchar *p = (const guchar *) error; match != 1 && p && *p; p++) {
+        state = g_array_index(classifier->states, state_t, state).next[*p < AUTOMATON_ALPHABET ? *p : 0];
+        found = g_array_index(classifier->states, state_t, state).match;
+
+        if (found && (best == 0 || found < best)) {
+            best = found;
+        }
+    }
+
+    if (best && (match == 0 || best < match)) {
+        match = best;
+    }
+
+    if (match == 0) {
+        record_unknown_error(context, error ? error : "", dest);
+        return VERDICT_UNKNOWN;
+    }
+
+    rule = &g_array_index(rules, rule_t, match - 1);
+
+    g_atomic_int_inc(&rule->hits);
+
+    return rule->verdict;
+}
+
+static gint compare_unknown_errors(gconstpointer a, gconstpointer b)
+{
+    const unknown_error_t *x = *(unknown_error_t **) a;
+    const unknown_error_t *y = *(unknown_error_t **) b;
+
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+
+    return g_strcmp0(x->error, y->error);
+}
+
+// Print how often each rule matched, and every error that no rule matched.
+void print_error_report(void)
+{
+    GHashTableIter iter;
+    GPtrArray *sorted;
+    gpointer value;
+
+    if (!enable_error_report || rules == NULL) {
+        return;
+    }
+
+    g_printerr("%-10s %-9s %-60s %-9s %9s\n", "CONTEXT", "MATCH", "PATTERN", "VERDICT", "HITS");
+
+    for (guint i = 0; i < rules->len; i++) {
+        rule_t *rule = &g_array_index(rules, rule_t, i);
+
+        g_printerr("%-10s %-9s %-60s %-9s %9d\n",
+                   context_names[rule->context],
+                   rule->substring ? "contains" : "exact",
+                   rule->pattern,
+                   verdict_to_str(rule->verdict),
+                   g_atomic_int_get(&rule->hits));
+    }
+
+    if (unknown_errors == NULL) {
+        return;
+    }
+
+    sorted = g_ptr_array_new();
+
+    g_hash_table_iter_init(&iter, unknown_errors);
+
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        g_ptr_array_add(sorted, value);
+    }
+
+    g_ptr_array_sort(sorted, compare_unknown_errors);
+
+    g_printerr("\n%-10s %-60s %9s %s\n", "CONTEXT", "UNKNOWN ERROR", "COUNT", "EXAMPLE");
+
+    for (guint i = 0; i < sorted->len; i++) {
+        unknown_error_t *unknown = g_ptr_array_index(sorted, i);
+
+        g_printerr("%-10s %-60s %9u %s\n",
+                   context_names[unknown->context],
+                   unknown->error,
+                   unknown->count,
+                   unknown->example ? unknown->example : "");
+    }
+
+    g_ptr_array_free(sorted, true);
+}
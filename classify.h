@@ -0,0 +1,20 @@
+#ifndef __CLASSIFY_H
+#define __CLASSIFY_H
+
+// Which kind of probe an error reply came from, each has its own rules.
+typedef enum {
+    ERROR_CONTEXT_METHOD,       // Calling a method with invalid arguments.
+    ERROR_CONTEXT_PROPERTY,     // Setting a property.
+    ERROR_CONTEXT_NAME,         // Requesting a well-known name.
+    ERROR_CONTEXT_MAX,
+} error_context_t;
+
+gboolean load_error_rules(const gchar *filename);
+verdict_t classify_error(error_context_t context, const gchar *error, const gchar *dest);
+void print_error_report(void);
+
+// Options
+extern gchar *error_rules_file;
+extern gboolean enable_error_report;
+
+#endif
@@ -2,7 +2,6 @@
 #include <gio/gio.h>
 #include <proc/readproc.h>
 #include <libxml/parser.h>
-#include <libxml/xpath.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -12,7 +11,22 @@
 #include "actions.h"
 #include "probes.h"
 #include "util.h"
+#include "cache.h"
+#include "scan.h"
+#include "parser.h"
 #include "introspect.h"
+#include "peers.h"
+#include "latency.h"
+#include "verdicts.h"
+#include "snapshot.h"
+#include "output.h"
+#include "watch.h"
+#include "activation.h"
+#include "wire.h"
+#include "stats.h"
+#include "trace.h"
+#include "classify.h"
+#include "buses.h"
 
 static gboolean enable_dump_methods;
 static gboolean enable_dump_properties;
@@ -21,26 +35,51 @@ static gboolean enable_invalid_args;
 static gboolean enable_null_agent;
 static gconstpointer enable_dump_actions;
 gint timeout = 500;
+static gint scan_jobs = 1;
+static gboolean enable_diff;
+static gboolean enable_watch;
 
 static gboolean handle_action_filter(const gchar *option_name, const gchar *value, gpointer data, GError **error);
+static gboolean handle_cache_dir(const gchar *option_name, const gchar *value, gpointer data, GError **error);
+static gboolean handle_output_format(const gchar *option_name, const gchar *value, gpointer data, GError **error);
+static gboolean handle_activation(const gchar *option_name, const gchar *value, gpointer data, GError **error);
 
 static GOptionEntry entries[] = {
     { "dump-methods", 0, 0, G_OPTION_ARG_NONE, &enable_dump_methods, "Attempt to dump reported methods", NULL },
     { "dump-properties", 0, 0, G_OPTION_ARG_NONE, &enable_dump_properties, "Attempt to dump supported properties", NULL },
     { "session", 0, 0, G_OPTION_ARG_NONE, &enable_session_bus, "Use the session bus instead of the system bus", NULL },
+    { "address", 0, 0, G_OPTION_ARG_STRING_ARRAY, &scan_addresses, "Scan this bus instead, can be repeated to scan several buses at once", "system|session|ADDRESS|GLOB" },
     { "include-invalid", 0, 0, G_OPTION_ARG_NONE, &enable_invalid_args, "Include properties that cannot be probed", NULL },
     { "enable-probes", 0, 0, G_OPTION_ARG_NONE, &enable_access_probes, "Try to query which props/methods are accessible (dangerous)", NULL },
     { "null-agent", 0, 0, G_OPTION_ARG_NONE, &enable_null_agent, "Create a polkit agent to dismiss prompts", NULL },
     { "dump-actions", 0, G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_CALLBACK, &handle_action_filter, "Attempt to dump PolicyKit actions", "[all,none,whatever]" },
     { "print-actions", 0, 0, G_OPTION_ARG_NONE, &enable_action_print, "Print actions as they are received by the agent", NULL },
+    { "check-actions", 0, 0, G_OPTION_ARG_STRING, &check_action_subjects, "Ask PolicyKit whether each subject is authorized for every action", "self,uid=N,pid=N,name=NAME,session=ID,active,inactive" },
     { "timeout", 0, 0, G_OPTION_ARG_INT, &timeout, "timeout in milliseconds for sending dbus message, or -1 for infinite", "N" },
     { "auth-password", 0, 0, G_OPTION_ARG_STRING, &polkit_auth_password, "If specified, send polkit the specified password", "password" },
+    { "jobs", 'j', 0, G_OPTION_ARG_INT, &scan_jobs, "Scan up to N services in parallel, each worker with its own bus connection", "N" },
+    { "cache", 0, G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_CALLBACK, &handle_cache_dir, "Reuse introspection data for services that have not restarted", "[DIR]" },
+    { "adaptive-timeout", 0, 0, G_OPTION_ARG_NONE, &enable_adaptive_timeout, "Derive per-service timeouts from observed latency, and skip services that stop responding", NULL },
+    { "sample-siblings", 0, 0, G_OPTION_ARG_INT, &introspect_sample_siblings, "Stop introspecting sibling objects after N of them have the same interfaces", "N" },
+    { "pipeline", 0, 0, G_OPTION_ARG_INT, &introspect_pipeline, "Keep up to N Introspect calls in flight, must be below the broker reply limit (default: 0, disabled)", "N" },
+    { "max-depth", 0, 0, G_OPTION_ARG_INT, &introspect_max_depth, "Don't walk objects more than N levels below the root (default: 0, unlimited)", "N" },
+    { "max-children", 0, 0, G_OPTION_ARG_INT, &introspect_max_children, "Only walk the first N children of each object (default: 0, unlimited)", "N" },
+    { "max-paths", 0, 0, G_OPTION_ARG_INT, &introspect_max_paths, "Introspect at most N objects per service (default: 0, unlimited)", "N" },
+    { "format", 0, 0, G_OPTION_ARG_CALLBACK, &handle_output_format, "Output format, text or jsonl (one JSON object per line)", "FORMAT" },
+    { "snapshot", 0, 0, G_OPTION_ARG_FILENAME, &snapshot_file, "Save a compact snapshot of the results to FILE", "FILE" },
+    { "diff", 0, 0, G_OPTION_ARG_NONE, &enable_diff, "Compare two snapshots given as OLD NEW, instead of scanning", NULL },
+    { "watch", 0, 0, G_OPTION_ARG_NONE, &enable_watch, "After scanning, keep running and report changes as services come and go", NULL },
+    { "activation", 0, 0, G_OPTION_ARG_CALLBACK, &handle_activation, "How to scan activatable names that aren't running, start, skip, no-auto-start or queue[:N]", "POLICY" },
+    { "native", 0, 0, G_OPTION_ARG_NONE, &enable_wire_transport, "Send scan traffic over a native connection instead of GDBus, unix sockets only", NULL },
+    { "stats", 0, 0, G_OPTION_ARG_NONE, &enable_stats, "Print call counts and latency for each phase of the scan to stderr", NULL },
+    { "record", 0, 0, G_OPTION_ARG_FILENAME, &trace_record_file, "Save every request and reply to a trace FILE", "FILE" },
+    { "replay", 0, 0, G_OPTION_ARG_FILENAME, &trace_replay_file, "Scan using the replies recorded in a trace FILE, instead of the bus", "FILE" },
+    { "error-rules", 0, 0, G_OPTION_ARG_FILENAME, &error_rules_file, "Classify probe errors using the rules in FILE before the built-in rules", "FILE" },
+    { "error-report", 0, 0, G_OPTION_ARG_NONE, &enable_error_report, "Print how often each error rule matched and any unrecognised errors to stderr", NULL },
     { NULL },
 };
 
 
-typedef void (* introspect_cb_t) (xmlDocPtr doc, GDBusConnection *bus, const gchar *dest, const gchar *path, gpointer user);
-
 static gboolean handle_action_filter(G_GNUC_UNUSED const gchar *option_name,
                                      const gchar *value,
                                      G_GNUC_UNUSED gpointer data,
@@ -50,45 +89,37 @@ static gboolean handle_action_filter(G_GNUC_UNUSED const gchar *option_name,
     return true;
 }
 
-// Return a procps structure for the owner of the specified DBus name. This is
-// useful to query more information than DBus exposes (e.g. fsuid).
-//
-// Returns NULL on error, or a pointer that should be freed with freeproc().
-proc_t * get_name_process(GDBusConnection *bus, gchar *name)
+static gboolean handle_cache_dir(G_GNUC_UNUSED const gchar *option_name,
+                                 const gchar *value,
+                                 G_GNUC_UNUSED gpointer data,
+                                 G_GNUC_UNUSED GError **error)
 {
-    PROCTAB      *proctab;
-    GDBusMessage *request;
-    GDBusMessage *reply;
-    GVariant     *body;
-    proc_t       *result;
-    guint32       pidlist[] = { 0, 0 };
-
-    request = g_dbus_message_new_method_call("org.freedesktop.DBus",
-                                             "/org/freedesktop/DBus",
-                                             "org.freedesktop.DBus",
-                                             "GetConnectionUnixProcessID");
-
-    g_dbus_message_set_body(request, g_variant_new ("(s)", name));
-
-    reply = g_dbus_send(bus, request, G_DBUS_SEND_MESSAGE_FLAGS_NONE, timeout, NULL, NULL, NULL);
-
-    body = g_dbus_message_get_body(reply);
+    introspect_cache_dir = value ? g_strdup(value) : g_build_filename(g_get_user_cache_dir(), "dbus-map", NULL);
+    return true;
+}
 
-    if (g_strcmp0(g_variant_type_peek_string(g_variant_get_type(body)), "(u)") != 0) {
-        return NULL;
+static gboolean handle_output_format(const gchar *option_name,
+                                     const gchar *value,
+                                     G_GNUC_UNUSED gpointer data,
+                                     GError **error)
+{
+    if (!parse_output_format(value)) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "%s must be text or jsonl", option_name);
+        return false;
     }
+    return true;
+}
 
-    g_variant_get(body, "(u)", &pidlist[0]);
-
-    proctab = openproc(PROC_FILLSTAT | PROC_FILLUSR | PROC_FILLGRP
-                     | PROC_FILLSTATUS | PROC_FILLSUPGRP | PROC_PID
-                     | PROC_FILLCOM | PROC_FILLENV, pidlist);
-    result  = readproc(proctab, NULL);
-    closeproc(proctab);
-
-    g_object_unref(request);
-    g_object_unref(reply);
-    return result;
+static gboolean handle_activation(const gchar *option_name,
+                                  const gchar *value,
+                                  G_GNUC_UNUSED gpointer data,
+                                  GError **error)
+{
+    if (!parse_activation_policy(value)) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "%s must be start, skip, no-auto-start or queue[:N]", option_name);
+        return false;
+    }
+    return true;
 }
 
 // For the specified D-Bus destination, get any available Introspection XML.
@@ -119,8 +150,11 @@ gchar * get_name_introspect(GDBusConnection *bus, const gchar *name, const gchar
 }
 
 // Return a list of D-Bus names that the server reports as an array of strings
-// in a GVariant.
-GVariant * get_service_list(GDBusConnection *bus)
+// in a GVariant. Names that are activatable but not running are added to
+// inactive.
+//
+// Returns NULL if the names couldn't be listed.
+GVariant * get_service_list(GDBusConnection *bus, GHashTable *inactive)
 {
     GHashTable *filter;
     GVariantIter *iter;
@@ -129,7 +163,7 @@ GVariant * get_service_list(GDBusConnection *bus)
     GVariant *avail;
     gpointer value;
 
-    filter = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, NULL);
+    filter = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 
     g_variant_builder_init(&builder, G_VARIANT_TYPE_ARRAY);
 
@@ -146,49 +180,438 @@ GVariant * get_service_list(GDBusConnection *bus)
                                                "ListActivatableNames"),
                                  "(as)");
 
-    g_variant_get(avail, "(as)", &iter);
+    if (names == NULL) {
+        if (avail)
+            g_variant_unref(avail);
+        g_variant_builder_clear(&builder);
+        g_hash_table_destroy(filter);
+        return NULL;
+    }
+
+    // Not every broker supports activation.
+    if (avail) {
+        g_variant_get(avail, "(as)", &iter);
 
-    while (g_variant_iter_loop(iter, "s", &value)) {
-        if (!g_hash_table_contains(filter, value)) {
-            g_hash_table_add(filter, value);
-            g_variant_builder_add(&builder, "s", value);
+        while (g_variant_iter_loop(iter, "s", &value)) {
+            if (!g_hash_table_contains(filter, value)) {
+                g_hash_table_add(filter, g_strdup(value));
+                g_hash_table_add(inactive, g_strdup(value));
+                g_variant_builder_add(&builder, "s", value);
+            }
         }
-    }
 
+        g_variant_iter_free(iter);
+        g_variant_unref(avail);
+    }
 
     g_variant_get(names, "(as)", &iter);
 
     while (g_variant_iter_loop(iter, "s", &value)) {
+        g_hash_table_remove(inactive, value);
+
         if (!g_hash_table_contains(filter, value)) {
-            g_hash_table_add(filter, value);
+            g_hash_table_add(filter, g_strdup(value));
             g_variant_builder_add(&builder, "s", value);
         }
     }
 
+    g_variant_iter_free(iter);
+    g_variant_unref(names);
+
     g_hash_table_destroy(filter);
     return g_variant_builder_end(&builder);
 }
 
-void xml_node_callback(xmlDocPtr doc, GDBusConnection *bus, const gchar *dest, const gchar *path, gpointer user)
+void node_info_callback(node_info_t *info, GDBusConnection *bus, const gchar *dest, const gchar *path, gpointer user)
 {
     if (enable_dump_methods) {
-        list_dbus_methods(doc, bus, dest, path, user);
+        list_dbus_methods(info, bus, dest, path, user);
     }
 
     if (enable_dump_properties) {
-        list_dbus_properties(doc, bus, dest, path, user);
+        list_dbus_properties(info, bus, dest, path, user);
     }
 }
 
-int main(int argc, char **argv)
+// Print the process table entry for a name, then walk and probe its object tree.
+static void scan_service(scan_t *scan)
 {
-    GHashTable *methods;
-    GOptionContext *context;
+    introspect_walk_t walk;
+    peer_table_t *table = scan->peers;
+    gboolean started = false;
+    GPtrArray *names;
+    proc_t *p;
+    gchar *path;
+    gint64 start = stats_start();
+
+    walk = introspect_pipeline > 0 ? crawl_introspection_nodes : descend_introspection_nodes;
+
+    // The owner didn't exist when the peer table was built.
+    if (scan->activatable && activation_policy == ACTIVATION_QUEUE) {
+        if ((started = activate_service(scan->bus, scan->name))) {
+            names = g_ptr_array_new();
+            g_ptr_array_add(names, scan->name);
+            table = get_peer_table(scan->bus, names);
+            g_ptr_array_free(names, true);
+        }
+    }
+
+    p = get_peer_process(table, scan->name);
+
+    report_service(scan, p, check_name_protected(scan->bus, scan->name));
+
+    path                = g_strdelimit(g_strdup_printf("/%s", scan->name), ".", '/');
+    scan->fingerprint   = get_peer_fingerprint(table, scan->name);
+    scan->cache         = open_introspect_cache(scan->label, scan->name, scan->fingerprint);
+
+    // Call each method with invalid args and see if it gives AccessDenied. If it does, why list it, method_call is banned?
+    walk(scan, "/", node_info_callback);
+
+    // Skip unique names.
+    if (*scan->name != ':') {
+        walk(scan, path, node_info_callback);
+    }
+
+    // By default the first message starts the service.
+    if (scan->activatable && activation_policy == ACTIVATION_START) {
+        started = name_has_owner(scan->bus, scan->name);
+    }
+
+    if (started) {
+        report_activation(scan);
+    }
+
+    if (table != scan->peers) {
+        free_peer_table(table);
+    }
+
+    close_introspect_cache(scan->cache);
+    g_free(path);
+
+    scan->cache = NULL;
+
+    record_stats(STATS_SERVICE, get_service_key(scan->bus, scan->name), start, false);
+}
+
+// Called by watch mode when a name changes owner, or when objects are added
+// below root. The owner may not have existed when the peer table was built,
+// so a new one is built for just this name.
+static void rescan_service(scan_t *scan, const gchar *root)
+{
+    introspect_walk_t walk;
+    peer_table_t *peers = scan->peers;
+    GPtrArray *names;
+
+    names = g_ptr_array_new();
+    g_ptr_array_add(names, scan->name);
+    scan->peers = get_peer_table(scan->bus, names);
+    g_ptr_array_free(names, true);
+
+    if (root == NULL) {
+        scan_service(scan);
+    } else {
+        walk = introspect_pipeline > 0 ? crawl_introspection_nodes : descend_introspection_nodes;
+
+        report_service(scan, get_peer_process(scan->peers, scan->name), check_name_protected(scan->bus, scan->name));
+        walk(scan, root, node_info_callback);
+    }
+
+    free_peer_table(scan->peers);
+    scan->peers = peers;
+}
+
+// Each worker thread owns a private connection to the bus, so that a slow
+// service only holds up the worker scanning it. The connection remembers its
+// address, as GLib may hand an idle thread to the pool of another bus.
+static GPrivate worker_bus = G_PRIVATE_INIT(g_object_unref);
+static GMutex worker_lock;
+static GCond worker_cond;
+
+#define WORKER_ADDRESS_KEY "dbus-map-worker-address"
+
+static void scan_worker(gpointer data, gpointer user)
+{
+    const gchar *address = user;
+    scan_t *scan = data;
+    GError *error = NULL;
+
+    scan->bus = g_private_get(&worker_bus);
+
+    if (scan->bus && g_strcmp0(g_object_get_data(G_OBJECT(scan->bus), WORKER_ADDRESS_KEY), address) != 0) {
+        g_private_replace(&worker_bus, NULL);
+        scan->bus = NULL;
+    }
+
+    // Replies come from the trace, there's no bus to connect to.
+    if (!trace_replay_file && !scan->bus) {
+        scan->bus = g_dbus_connection_new_for_address_sync(address,
+                                                           G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT
+                                                         | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                           NULL,
+                                                           NULL,
+                                                           &error);
+        if (scan->bus == NULL) {
+            g_warning("worker failed to connect to %s, %s", address, error->message);
+            g_error_free(error);
+        } else {
+            if (enable_wire_transport)
+                attach_wire_transport(scan->bus, address);
+            g_object_set_data_full(G_OBJECT(scan->bus), WORKER_ADDRESS_KEY, g_strdup(address), g_free);
+            if (scan->label)
+                set_bus_label(scan->bus, scan->label);
+            g_private_set(&worker_bus, scan->bus);
+        }
+    }
+
+    if (scan->bus || trace_replay_file) {
+        scan_service(scan);
+    }
+
+    g_mutex_lock(&worker_lock);
+    scan->done = true;
+    g_cond_broadcast(&worker_cond);
+    g_mutex_unlock(&worker_lock);
+}
+
+// How polkit prompts are answered, which changes what a probe can reach.
+static const gchar * get_agent_mode(void)
+{
+    if (!enable_null_agent) {
+        return "none";
+    }
+
+    return polkit_auth_password ? "password" : "dismiss";
+}
+
+// Everything needed to scan the names on one bus.
+typedef struct {
+    bus_address_t   *target;    // NULL when replaying a trace.
+    const gchar     *label;     // Tags results, NULL unless --address was used.
+    const gchar     *filter;    // If not NULL, only scan this name.
     GDBusConnection *bus;
-    GVariant *list;
+    GHashTable      *inactive;  // Activatable names that aren't running.
+    GVariant        *list;
+    GPtrArray       *scans;
+    GPtrArray       *names;
+    peer_table_t    *peers;
+    GError          *error;     // Set if the bus couldn't be scanned.
+} bus_scan_t;
+
+static bus_scan_t * new_bus_scan(bus_address_t *target, const gchar *filter)
+{
+    bus_scan_t *state = g_new0(bus_scan_t, 1);
+
+    state->target   = target;
+    state->label    = target && scan_addresses ? target->label : NULL;
+    state->filter   = filter;
+
+    return state;
+}
+
+static void free_bus_scan(bus_scan_t *state)
+{
+    for (guint i = 0; state->scans && i < state->scans->len; i++) {
+        free_scan(g_ptr_array_index(state->scans, i));
+    }
+
+    if (state->scans)
+        g_ptr_array_free(state->scans, true);
+    if (state->names)
+        g_ptr_array_free(state->names, true);
+    if (state->peers)
+        free_peer_table(state->peers);
+    if (state->list)
+        g_variant_unref(state->list);
+    if (state->inactive)
+        g_hash_table_destroy(state->inactive);
+    if (state->bus)
+        g_object_unref(state->bus);
+
+    g_clear_error(&state->error);
+    g_free(state);
+}
+
+static gboolean connect_bus(bus_scan_t *state)
+{
+    // Replies come from the trace, there's no bus to connect to.
+    if (state->target == NULL) {
+        return true;
+    }
+
+    if (!(state->bus = open_bus_address(state->target, &state->error))) {
+        return false;
+    }
+
+    if (state->label) {
+        set_bus_label(state->bus, state->label);
+    }
+
+    if (enable_wire_transport && !attach_wire_transport(state->bus, state->target->address)) {
+        g_message("native transport is not available, using GDBus");
+    }
+
+    return true;
+}
+
+// List the names on the bus and resolve their owners, ready for
+// scan_bus_services().
+static gboolean list_bus_services(bus_scan_t *state)
+{
     GVariantIter *iter;
     gchar *str;
-    gchar *path;
+
+    state->inactive = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    if (!(state->list = get_service_list(state->bus, state->inactive))) {
+        g_set_error(&state->error, G_IO_ERROR, G_IO_ERROR_FAILED, "failed to list names");
+        return false;
+    }
+
+    state->scans = g_ptr_array_new();
+    state->names = g_ptr_array_new();
+
+    g_variant_get(state->list, "as", &iter);
+
+    while (g_variant_iter_loop(iter, "s", &str)) {
+        scan_t *scan;
+
+        // If a name is specified on the commandline, limit output to that service.
+        if (state->filter && g_strcmp0(str, state->filter) != 0) {
+            continue;
+        }
+
+        if (activation_policy == ACTIVATION_SKIP && g_hash_table_contains(state->inactive, str)) {
+            g_debug("skipping %s, it's not running", str);
+            continue;
+        }
+
+        scan = new_scan(state->bus, str);
+        scan->label = state->label;
+        scan->activatable = g_hash_table_contains(state->inactive, str);
+
+        // Watch mode needs to know what was found, to report changes.
+        if (enable_watch) {
+            scan->verdicts = g_hash_table_new(g_direct_hash, g_direct_equal);
+        }
+
+        g_ptr_array_add(state->scans, scan);
+        g_ptr_array_add(state->names, scan->name);
+    }
+
+    g_variant_iter_free(iter);
+
+    state->peers = get_peer_table(state->bus, state->names);
+
+    for (guint i = 0; i < state->scans->len; i++) {
+        ((scan_t *) g_ptr_array_index(state->scans, i))->peers = state->peers;
+    }
+
+    return true;
+}
+
+// Scan every name listed, with up to scan_jobs workers. Text output is printed
+// in list order, unless buffer is set, in which case it's left in each
+// scan->output for the caller.
+static void scan_bus_services(bus_scan_t *state, gboolean buffer)
+{
+    GThreadPool *pool;
+
+    // JSON Lines records are self-describing and written directly.
+    for (guint i = 0; i < state->scans->len && output_format == OUTPUT_FORMAT_TEXT; i++) {
+        scan_t *scan = g_ptr_array_index(state->scans, i);
+
+        if (buffer || scan_jobs > 1)
+            scan->output = g_string_new(NULL);
+    }
+
+    if (scan_jobs <= 1) {
+        for (guint i = 0; i < state->scans->len; i++) {
+            scan_service(g_ptr_array_index(state->scans, i));
+        }
+        return;
+    }
+
+    // Workers don't connect to anything when replaying.
+    pool = g_thread_pool_new(scan_worker, state->target ? state->target->address : NULL, scan_jobs, true, NULL);
+
+    for (guint i = 0; i < state->scans->len; i++) {
+        g_thread_pool_push(pool, g_ptr_array_index(state->scans, i), NULL);
+    }
+
+    // Print results in list order as soon as each one is complete, so
+    // output is identical regardless of scheduling.
+    for (guint i = 0; i < state->scans->len && !buffer; i++) {
+        scan_t *scan = g_ptr_array_index(state->scans, i);
+
+        g_mutex_lock(&worker_lock);
+        while (!scan->done)
+            g_cond_wait(&worker_cond, &worker_lock);
+        g_mutex_unlock(&worker_lock);
+
+        if (scan->output)
+            g_print("%s", scan->output->str);
+    }
+
+    g_thread_pool_free(pool, false, true);
+}
+
+static gpointer scan_bus_thread(gpointer data)
+{
+    bus_scan_t *state = data;
+
+    if (connect_bus(state) && list_bus_services(state)) {
+        scan_bus_services(state, true);
+    }
+
+    return NULL;
+}
+
+// Scan several buses at once, each from its own thread over its own
+// connections. Text output is printed one bus at a time, in the order given.
+static void scan_buses(GPtrArray *targets, const gchar *filter)
+{
+    GPtrArray *buses = g_ptr_array_new_with_free_func((GDestroyNotify) free_bus_scan);
+    GPtrArray *threads = g_ptr_array_new();
+
+    report_header();
+
+    for (guint i = 0; i < targets->len; i++) {
+        bus_scan_t *state = new_bus_scan(g_ptr_array_index(targets, i), filter);
+
+        g_ptr_array_add(buses, state);
+        g_ptr_array_add(threads, g_thread_new("bus", scan_bus_thread, state));
+    }
+
+    for (guint i = 0; i < buses->len; i++) {
+        bus_scan_t *state = g_ptr_array_index(buses, i);
+
+        g_thread_join(g_ptr_array_index(threads, i));
+
+        report_bus(state->label, state->target->address, state->scans ? state->scans->len : 0, state->error);
+
+        for (guint j = 0; state->scans && j < state->scans->len; j++) {
+            scan_t *scan = g_ptr_array_index(state->scans, j);
+
+            if (scan->output)
+                g_print("%s", scan->output->str);
+        }
+    }
+
+    g_ptr_array_free(threads, true);
+    g_ptr_array_unref(buses);
+}
+
+int main(int argc, char **argv)
+{
+    GOptionContext *context;
+    GPtrArray *targets = NULL;
+    watcher_t *watcher = NULL;
+    bus_scan_t *state;
+    gchar *defaults[] = { "system", NULL };
+
+    // Introspection documents are parsed on worker threads, and older libxml2
+    // releases need global state set up on the main thread first.
+    xmlInitParser();
 
     context = g_option_context_new("[NAME]");
 
@@ -199,55 +622,129 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    bus     = g_bus_get_sync(enable_session_bus ? G_BUS_TYPE_SESSION : G_BUS_TYPE_SYSTEM, NULL, NULL);
-    list    = get_service_list(bus);
+    g_option_context_free(context);
+
+    if (enable_diff) {
+        if (argc != 3) {
+            g_message("--diff requires two snapshot filenames");
+            return 1;
+        }
+
+        return diff_snapshots(argv[1], argv[2]) ? 0 : 1;
+    }
+
+    if (!load_error_rules(error_rules_file)) {
+        return 1;
+    }
+
+    if (trace_replay_file) {
+        // Caches are keyed by fingerprints of processes on this host.
+        if (enable_watch || enable_null_agent || scan_addresses || introspect_cache_dir) {
+            g_message("--replay cannot be used with --watch, --null-agent, --address or --cache");
+            return 1;
+        }
+
+        if (!load_trace(trace_replay_file)) {
+            return 1;
+        }
+    } else {
+        if (enable_session_bus) {
+            defaults[0] = "session";
+        }
+
+        if (!(targets = expand_bus_addresses(scan_addresses ? scan_addresses : defaults))) {
+            return 1;
+        }
+
+        if (targets->len == 0) {
+            g_message("no buses found to scan");
+            return 1;
+        }
+    }
+
+    if (targets && targets->len > 1) {
+        if (enable_watch || enable_null_agent || check_action_subjects || enable_dump_actions || trace_record_file) {
+            g_message("--watch, --null-agent, --check-actions, --dump-actions and --record only support one bus");
+            return 1;
+        }
+
+        if (enable_access_probes) {
+            load_verdict_cache(get_agent_mode());
+        }
+
+        scan_buses(targets, argc > 1 ? argv[1] : NULL);
+        goto finished;
+    }
+
+    state = new_bus_scan(targets ? g_ptr_array_index(targets, 0) : NULL, argc > 1 ? argv[1] : NULL);
+
+    if (!connect_bus(state)) {
+        g_message("failed to connect to %s, %s", state->target->label, state->error->message);
+        return 1;
+    }
+
+    if (check_action_subjects) {
+        gboolean result = check_action_matrix(state->bus, check_action_subjects);
+        if (trace_record_file)
+            save_trace(trace_record_file);
+        return result ? 0 : 1;
+    }
 
     if (enable_dump_actions) {
-        get_action_list(bus, enable_dump_actions);
+        get_action_list(state->bus, enable_dump_actions);
+        if (trace_record_file)
+            save_trace(trace_record_file);
         return 0;
     }
 
     if (enable_null_agent) {
-        register_polkit_agent(bus, getpid());
+        register_polkit_agent(state->bus, getpid());
     }
 
-    g_option_context_free(context);
-    g_variant_get(list, "as", &iter);
+    if (enable_access_probes) {
+        load_verdict_cache(get_agent_mode());
+    }
 
-    g_print("%s\t%16s\t%40s\t%32s\n", "PID", "USER", "NAME", "CMDLINE");
+    // Changes during the scan are queued and handled once it's finished.
+    if (enable_watch) {
+        watcher = start_watching(state->bus, state->filter, rescan_service);
+    }
 
-    while (g_variant_iter_loop(iter, "s", &str)) {
-        proc_t  *p = get_name_process(bus, str);
+    if (!list_bus_services(state)) {
+        g_message("%s", state->error->message);
+        return 1;
+    }
 
-        // If a name is specified on the commandline, limit output to that service.
-        if (argc > 1 && g_strcmp0(str, argv[1]) != 0) {
-            continue;
-        }
+    report_header();
 
-        if (p) {
-            g_print("%d\t%16s\t%40s%c\t%32s", p->tid, p->euser, str, check_name_protected(bus, str) ? ' ' : '!', p->cmdline[0]);
-            for (gint i = 1; p->cmdline[i]; i++)
-                g_print(" %s", p->cmdline[i]);
-            g_print("\n");
-        } else {
-            g_print("%d\t%16s\t%40s%c\t%32s\n", -1, "unknown", str, check_name_protected(bus, str) ? ' ' : '!', "");
-        }
+    if (state->label) {
+        report_bus(state->label, state->target->address, state->scans->len, NULL);
+    }
 
-        path    = g_strdelimit(g_strdup_printf("/%s", str), ".", '/');
-        methods = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    scan_bus_services(state, false);
 
-        // Call each method with invalid args and see if it gives AccessDenied. If it does, why list it, method_call is banned?
-        descend_introspection_nodes(bus, str, "/", xml_node_callback, methods);
+    if (watcher) {
+        watch_services(watcher, state->scans);
+    }
 
-        // Skip unique names.
-        if (*str != ':') {
-            descend_introspection_nodes(bus, str, path, xml_node_callback, methods);
-        }
+    free_bus_scan(state);
+
+  finished:
+    if (targets)
+        g_ptr_array_unref(targets);
+
+    if (snapshot_file) {
+        save_snapshot(snapshot_file);
+    }
 
-        g_hash_table_destroy(methods);
-        freeproc(p);
+    if (trace_record_file) {
+        save_trace(trace_record_file);
     }
 
+    save_verdict_cache();
+    print_latency_summary();
+    print_stats_summary();
+    print_error_report();
     xmlCleanupParser();
     return 0;
 }
@@ -1,7 +1,6 @@
 #define _GNU_SOURCE
 #include <gio/gio.h>
-#include <libxml/parser.h>
-#include <libxml/xpath.h>
+#include <proc/readproc.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -10,30 +9,38 @@
 #include "polkitagent.h"
 #include "actions.h"
 #include "util.h"
-#include "introspect.h"
+#include "cache.h"
+#include "parser.h"
 #include "probes.h"
+#include "verdicts.h"
+#include "scan.h"
+#include "introspect.h"
+#include "snapshot.h"
+#include "output.h"
+#include "stats.h"
+#include "symbols.h"
 
-// I'm not particularly concerned about xmlChar vs char.
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wpointer-sign"
-
-typedef void (* introspect_cb_t) (xmlDocPtr doc, GDBusConnection *bus, const gchar *dest, const gchar *path, gpointer user);
-
-// For the specified D-Bus destination, get any available Introspection XML.
+// For the specified D-Bus destination, get any available Introspection XML,
+// from the cache if the service hasn't changed since it was stored.
 //
 // Returns NULL, or a pointer you should free with g_free().
-static gchar * get_name_introspect(GDBusConnection *bus, const gchar *name, const gchar *path)
+static gchar * get_name_introspect(scan_t *scan, const gchar *path)
 {
     GVariant     *data;
     gchar        *xml;
 
     g_return_val_if_fail(g_variant_is_object_path(path), NULL);
 
-    data = g_dbus_simple_send(bus, g_dbus_method(name, path, "org.freedesktop.DBus.Introspectable", "Introspect"), "(s)");
+    if ((xml = lookup_introspect_cache(scan->cache, path))) {
+        return xml;
+    }
+
+    data = g_dbus_simple_send(scan->bus, g_dbus_method(scan->name, path, "org.freedesktop.DBus.Introspectable", "Introspect"), "(s)");
 
     if (data) {
         g_variant_get(data, "(s)", &xml);
         g_variant_unref(data);
+        update_introspect_cache(scan->cache, path, xml);
         return xml;
     }
 
@@ -41,158 +48,765 @@ static gchar * get_name_introspect(GDBusConnection *bus, const gchar *name, cons
     return NULL;
 }
 
-void list_dbus_methods(xmlDocPtr doc, GDBusConnection *bus, const gchar *dest, const gchar *path, gpointer user)
+// In watch mode, remember the verdict for a member, and decide whether it has
+// changed since the previous scan of this name.
+static gboolean record_member_verdict(scan_t *scan, symbol_t key, verdict_t verdict)
 {
-    GHashTable *methods = user;
-    xmlXPathContextPtr context;
-    xmlXPathObjectPtr result;
-    xmlNodeSetPtr nodes;
-
-    context = xmlXPathNewContext(doc);
+    gpointer previous;
 
-    result = xmlXPathEvalExpression("/node/interface/method[@name]", context);
+    if (scan->verdicts == NULL) {
+        return true;
+    }
 
-    xmlXPathFreeContext(context);
+    g_hash_table_insert(scan->verdicts, GUINT_TO_POINTER(key), GINT_TO_POINTER(verdict + 1));
 
-    if (!result) {
-        g_debug("xpath query failed for method declarations");
-        return;
+    if (scan->previous && (previous = g_hash_table_lookup(scan->previous, GUINT_TO_POINTER(key)))) {
+        return GPOINTER_TO_INT(previous) - 1 != (gint) verdict;
     }
 
-    if (!result->nodesetval) {
-        g_debug("no results for xpath query");
-        xmlXPathFreeObject(result);
-        return;
+    return true;
+}
+
+void list_dbus_methods(node_info_t *info, GDBusConnection *bus, const gchar *dest, const gchar *path, gpointer user)
+{
+    scan_t *scan = user;
+    verdict_t verdict;
+
+    for (guint i = 0; i < info->methods->len; i++) {
+        member_info_t *method = &g_array_index(info->methods, member_info_t, i);
+        symbol_t key = intern_member('m', method->interface, method->name);
+
+        if (!g_hash_table_add(scan->members, GUINT_TO_POINTER(key))) {
+            continue;
+        }
+
+        if (!lookup_verdict(scan->label, scan->fingerprint, 'm', method->interface, method->name, method->signature, &verdict)) {
+            verdict = check_access_method(bus, dest, path, method->interface, method->name, method->signature);
+            store_verdict(scan->label, scan->fingerprint, 'm', method->interface, method->name, method->signature, verdict);
+        }
+
+        if (record_member_verdict(scan, key, verdict)) {
+            report_member(scan, 'm', path, method, verdict);
+        }
     }
 
-    nodes = result->nodesetval;
+    return;
+}
+
+void list_dbus_properties(node_info_t *info, GDBusConnection *bus, const gchar *dest, const gchar *path, gpointer user)
+{
+    scan_t *scan = user;
+    verdict_t verdict;
+    const gchar *fetched = NULL;
+    GVariant *values = NULL;
 
-    for (gint i = 0; i < nodes->nodeNr; i++) {
-        xmlAttrPtr attrib = nodes->nodeTab[i]->properties;
-        gchar *method;
+    for (guint i = 0; i < info->properties->len; i++) {
+        member_info_t *property = &g_array_index(info->properties, member_info_t, i);
+        symbol_t key = intern_member('p', property->interface, property->name);
 
-        method = g_strdup_printf("m:%s.%s", nodes->nodeTab[i]->parent->properties->children->content, attrib->children->content);
+        if (!g_hash_table_add(scan->members, GUINT_TO_POINTER(key))) {
+            continue;
+        }
 
-        if (!g_hash_table_contains(methods, method)) {
-            g_hash_table_add(methods, method);
-            gchar* sig = get_method_signature(nodes->nodeTab[i]);
-            if (check_access_method(bus,
-                                    dest,
-                                    path,
-                                    nodes->nodeTab[i]->parent->properties->children->content,
-                                    attrib->children->content,
-                                    sig)) {
-                g_print("\t%s %s\n", method, path);
+        // There's no point trying to set a property that the service says
+        // can't be changed, and it avoids any side effects if it can. A const
+        // annotation only says the value doesn't change on its own, so
+        // writable const properties are still probed.
+        if (property->access == PROPERTY_ACCESS_READ) {
+            verdict = enable_access_probes ? VERDICT_READONLY : VERDICT_UNPROBED;
+        } else if (!lookup_verdict(scan->label, scan->fingerprint, 'p', property->interface, property->name, property->signature, &verdict)) {
+            // Read all the values of this interface at once, the first time one
+            // of its properties needs probing.
+            if (enable_access_probes && g_strcmp0(fetched, property->interface) != 0) {
+                if (values)
+                    g_variant_unref(values);
+                values  = get_all_properties(bus, dest, path, property->interface);
+                fetched = property->interface;
             }
-            g_free(sig);
+
+            verdict = check_access_property(bus,
+                                            dest,
+                                            path,
+                                            property->interface,
+                                            property->name,
+                                            property->signature,
+                                            property->access != PROPERTY_ACCESS_WRITE,
+                                            values);
+            store_verdict(scan->label, scan->fingerprint, 'p', property->interface, property->name, property->signature, verdict);
+        }
+
+        if (record_member_verdict(scan, key, verdict)) {
+            report_member(scan, 'p', path, property, verdict);
         }
     }
 
-    xmlXPathFreeObject(result);
+    if (values)
+        g_variant_unref(values);
+
     return;
 }
 
-void list_dbus_properties(xmlDocPtr doc, GDBusConnection *bus, const gchar *dest, const gchar *path, gpointer user)
+// Options
+gint introspect_pipeline;
+gint introspect_sample_siblings;
+gint introspect_max_depth;
+gint introspect_max_children;
+gint introspect_max_paths;
+
+static gboolean node_has_interface(node_info_t *info, const gchar *interface)
+{
+    for (guint i = 0; i < info->interfaces->len; i++) {
+        if (g_strcmp0(g_ptr_array_index(info->interfaces, i), interface) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static gboolean is_below_path(const gchar *path, const gchar *root)
+{
+    gsize length = strlen(root);
+
+    if (strlen(path) <= length || !g_str_has_prefix(path, root)) {
+        return false;
+    }
+
+    return path[length] == '/' || g_strcmp0(root, "/") == 0;
+}
+
+// Returns true if an ObjectManager has already listed path, so it's either
+// queued for introspection or was reported as skipped.
+static gboolean is_managed_path(scan_t *scan, const gchar *path)
 {
-    GHashTable *methods = user;
-    xmlXPathContextPtr context;
-    xmlXPathObjectPtr result;
-    xmlNodeSetPtr nodes;
+    return scan->managed && g_hash_table_contains(scan->managed, path);
+}
 
-    context = xmlXPathNewContext(doc);
+// Returns how many levels object is below root.
+static guint get_relative_depth(const gchar *root, const gchar *object)
+{
+    const gchar *suffix = g_strcmp0(root, "/") == 0 ? object : object + strlen(root);
+    guint depth = 0;
 
-    result = xmlXPathEvalExpression("/node/interface/property[@name]", context);
+    for (; *suffix; suffix++) {
+        depth += *suffix == '/';
+    }
 
-    xmlXPathFreeContext(context);
+    return depth;
+}
+
+static gint compare_interface_names(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const gchar **) a, *(const gchar **) b);
+}
 
-    if (!result) {
-        g_debug("xpath query failed for property declarations");
+// An ObjectManager lists every object below it with a single call, which seeds
+// the walk. Only objects that implement an interface we haven't seen yet are
+// added to managed for introspection, the rest are reported as skipped,
+// grouped by the set of interfaces they implement. Either way they're
+// remembered, so the walk doesn't visit them again, but objects the manager
+// didn't list are still found by walking the subnodes as usual.
+static void list_managed_objects(scan_t *scan, const gchar *path, GPtrArray *managed)
+{
+    GDBusMessage *request;
+    GVariantIter *objects;
+    GVariantIter *interfaces;
+    GHashTableIter iter;
+    GHashTable *seen;
+    GHashTable *groups;
+    GHashTable *samples;
+    GVariant *reply;
+    const gchar *object;
+    const gchar *interface;
+    gpointer key;
+    gpointer value;
+
+    // Already listed, e.g. the manager is at the well-known path and was
+    // found while walking from the root.
+    if (scan->managers && g_ptr_array_find_with_equal_func(scan->managers, path, g_str_equal, NULL)) {
         return;
     }
 
-    if (!result->nodesetval) {
-        g_debug("no results for xpath query");
-        xmlXPathFreeObject(result);
+    request = g_dbus_method(scan->name, path, "org.freedesktop.DBus.ObjectManager", "GetManagedObjects");
+
+    if (!(reply = g_dbus_simple_send(scan->bus, request, "(a{oa{sa{sv}}})"))) {
+        g_debug("GetManagedObjects failed for %s @%s", scan->name, path);
         return;
     }
 
-    nodes = result->nodesetval;
+    if (scan->managers == NULL) {
+        scan->managers  = g_ptr_array_new_with_free_func(g_free);
+        scan->managed   = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+
+    g_ptr_array_add(scan->managers, g_strdup(path));
 
-    for (gint i = 0; i < nodes->nodeNr; i++) {
-        xmlAttrPtr attrib = nodes->nodeTab[i]->properties;
-        gchar *property;
+    seen    = g_hash_table_new(g_str_hash, g_str_equal);
+    groups  = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_ptr_array_unref);
+    samples = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
 
-        // Find the attribute name
-        while (g_strcmp0(attrib->name, "name") != 0) {
-            attrib = attrib->next;
-            g_assert(attrib);
+    g_variant_get(reply, "(a{oa{sa{sv}}})", &objects);
+
+    while (g_variant_iter_next(objects, "{&oa{sa{sv}}}", &object, &interfaces)) {
+        GPtrArray *names;
+        gboolean novel = false;
+        gchar *set;
+
+        // Objects outside the subtree must not affect what's introspected.
+        if (!is_below_path(object, path)) {
+            g_variant_iter_free(interfaces);
+            continue;
         }
 
-        property = g_strdup_printf("p:%s.%s", nodes->nodeTab[i]->parent->properties->children->content, attrib->children->content);
+        names = g_ptr_array_new();
 
-        if (!g_hash_table_contains(methods, property)) {
-            g_hash_table_add(methods, property);
-            gchar* sig = get_property_signature(nodes->nodeTab[i]);
-            if (check_access_property(bus, dest, path, nodes->nodeTab[i]->parent->properties->children->content, attrib->children->content, sig))
-                g_print("\t%s %s\n", property, path);
-            g_free(sig);
+        while (g_variant_iter_next(interfaces, "{&s@a{sv}}", &interface, NULL)) {
+            if (!g_hash_table_contains(seen, interface)) {
+                g_hash_table_add(seen, (gpointer) interface);
+                novel = true;
+            }
+            g_ptr_array_add(names, (gpointer) interface);
         }
+
+        g_variant_iter_free(interfaces);
+        g_ptr_array_sort(names, compare_interface_names);
+        g_ptr_array_add(names, NULL);
+
+        set = g_strjoinv(",", (gchar **) names->pdata);
+
+        g_ptr_array_free(names, true);
+
+        g_hash_table_add(scan->managed, g_strdup(object));
+
+        if (novel) {
+            g_ptr_array_add(managed, g_strdup(object));
+            g_hash_table_insert(samples, g_strdup(set), g_strdup(object));
+            g_free(set);
+            continue;
+        }
+
+        if (!(value = g_hash_table_lookup(groups, set))) {
+            value = g_ptr_array_new_with_free_func(g_free);
+            g_hash_table_insert(groups, g_strdup(set), value);
+        }
+
+        g_ptr_array_add(value, g_strdup(object));
+        g_free(set);
     }
 
-    xmlXPathFreeObject(result);
-    return;
+    g_debug("%s @%s manages %u interfaces, introspecting %u objects",
+            scan->name,
+            path,
+            g_hash_table_size(seen),
+            managed->len);
+
+    g_hash_table_iter_init(&iter, groups);
+
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        const gchar *sample = g_hash_table_lookup(samples, key);
+        report_skipped_objects(scan, value, 0, sample ? sample : g_ptr_array_index((GPtrArray *) value, 0));
+    }
+
+    g_variant_iter_free(objects);
+    g_variant_unref(reply);
+    g_hash_table_destroy(samples);
+    g_hash_table_destroy(groups);
+    g_hash_table_destroy(seen);
 }
 
-void descend_introspection_nodes(GDBusConnection *bus, gchar *name, const gchar *root, introspect_cb_t callback, gpointer user)
+// A service can export any number of objects, nested as deeply as it likes.
+// These limits stop a buggy or hostile service from stalling a scan, anything
+// beyond them is reported as truncated rather than walked.
+
+// Drop the subnodes of a node at depth that are beyond the depth or breadth
+// limits.
+static void limit_subpaths(scan_t *scan, const gchar *path, guint depth, GPtrArray *subpaths)
 {
-    xmlXPathContextPtr context;
-    xmlXPathObjectPtr result;
-    xmlNodeSetPtr nodes;
-    xmlDocPtr doc;
-    gchar *xml;
+    if (introspect_max_depth > 0 && depth >= (guint) introspect_max_depth && subpaths->len > 0) {
+        report_truncated_objects(scan, path, "max-depth", subpaths->len);
+        g_ptr_array_remove_range(subpaths, 0, subpaths->len);
+    }
 
-    g_debug("searching for object paths in %s @%s", name, root);
+    if (introspect_max_children > 0 && subpaths->len > (guint) introspect_max_children) {
+        report_truncated_objects(scan, path, "max-children", subpaths->len - introspect_max_children);
+        g_ptr_array_remove_range(subpaths, introspect_max_children, subpaths->len - introspect_max_children);
+    }
+}
 
-    if (!(xml = get_name_introspect(bus, name, root))) {
-        g_debug("failed to introspect %s", name);
-        return;
+// Drop the objects listed by a manager at path and depth that are beyond the
+// depth or breadth limits. Managed objects can be nested at any depth below
+// the manager, so each is checked against its own depth.
+static void limit_managed_objects(scan_t *scan, const gchar *path, guint depth, GPtrArray *managed)
+{
+    guint dropped = 0;
+
+    for (guint i = 0; introspect_max_depth > 0 && i < managed->len; i++) {
+        if (depth + get_relative_depth(path, g_ptr_array_index(managed, i)) > (guint) introspect_max_depth) {
+            g_ptr_array_remove_index(managed, i--);
+            dropped++;
+        }
     }
 
-    if (!(doc = xmlReadMemory(xml,
-                              strlen(xml),
-                              "noname.xml",
-                              NULL,
-                              XML_PARSE_NOERROR | XML_PARSE_NONET | XML_PARSE_NOWARNING))) {
-        g_debug("failed to parse introspect response as xml from %s", name);
-        return;
+    if (dropped) {
+        report_truncated_objects(scan, path, "max-depth", dropped);
+    }
+
+    if (introspect_max_children > 0 && managed->len > (guint) introspect_max_children) {
+        report_truncated_objects(scan, path, "max-children", managed->len - introspect_max_children);
+        g_ptr_array_remove_range(managed, introspect_max_children, managed->len - introspect_max_children);
+    }
+}
+
+// Count an object against the limit for this service.
+//
+// Returns false if the limit has been reached, and the object shouldn't be
+// introspected.
+static gboolean claim_walk_path(scan_t *scan)
+{
+    if (introspect_max_paths > 0 && scan->walked >= (guint) introspect_max_paths) {
+        return false;
     }
 
-    // Call user callback
-    callback(doc, bus, name, root, user);
+    scan->walked++;
+    return true;
+}
+
+// Invoke the callback for a parsed document, and add the full path of any
+// subnodes to subpaths. If the node is an ObjectManager, the objects it lists
+// that need introspecting are added to managed, at their own depth (see
+// get_relative_depth()). The root of a walk is at depth 0.
+//
+// Returns the shape of the node, or 0 if it couldn't be parsed.
+static guint64 visit_introspection_xml(scan_t *scan, const gchar *path, const gchar *xml, guint depth, introspect_cb_t callback, GPtrArray *subpaths, GPtrArray *managed)
+{
+    node_info_t *info;
+    guint64 shape;
+
+    if (!(info = parse_node_info(xml, strlen(xml)))) {
+        g_debug("failed to parse introspect response as xml from %s", scan->name);
+        return 0;
+    }
 
-    // Query parsed xml for any subnodes
-    context = xmlXPathNewContext(doc);
-    result  = xmlXPathEvalExpression("/node/node[@name]", context);
-    nodes   = result->nodesetval;
+    callback(info, scan->bus, scan->name, path, scan);
 
-    g_debug("discovered %u subnodes matching xpath expression", nodes->nodeNr);
+    g_debug("discovered %u subnodes under %s", info->nodes->len, path);
 
-    for (gint i = 0; i < nodes->nodeNr; i++) {
-        gchar *subpath = g_strdup_printf("%s%s%s", root, g_str_has_suffix(root, "/") ? "" : "/", nodes->nodeTab[i]->properties->children->content);
+    if (node_has_interface(info, "org.freedesktop.DBus.ObjectManager")) {
+        list_managed_objects(scan, path, managed);
+    }
 
-        // This is hacky trick to get the node name
-        g_debug("discovered sub-path name %s", subpath);
+    for (guint i = 0; i < info->nodes->len; i++) {
+        gchar *subpath = g_strdup_printf("%s%s%s",
+                                         path,
+                                         g_str_has_suffix(path, "/") ? "" : "/",
+                                         (gchar *) g_ptr_array_index(info->nodes, i));
 
-        descend_introspection_nodes(bus, name, subpath, callback, user);
+        if (is_managed_path(scan, subpath)) {
+            g_free(subpath);
+            continue;
+        }
 
-        g_free(subpath);
+        g_ptr_array_add(subpaths, subpath);
     }
 
-    xmlXPathFreeObject(result);
-    xmlXPathFreeContext(context);
-    xmlFree(doc);
+    limit_subpaths(scan, path, depth, subpaths);
+    limit_managed_objects(scan, path, depth, managed);
+
+    shape = get_node_shape(info);
+    free_node_info(info);
+    return shape;
+}
+
+// Services like systemd, UDisks and NetworkManager export thousands of sibling
+// objects that all implement the same interfaces, and introspecting them all
+// tells us nothing new. If the first introspect_sample_siblings children of a
+// node all have the same shape, the rest are listed but not introspected.
+static gboolean should_sample_siblings(GPtrArray *subpaths)
+{
+    return introspect_sample_siblings > 0 && subpaths->len > (guint) introspect_sample_siblings;
+}
+
+// The pipelined crawler keeps a window of Introspect calls outstanding, rather
+// than waiting for each reply before sending the next. Subnodes are queued as
+// soon as their parent arrives, so total time is roughly the depth of the
+// deepest tree multiplied by the round trip time.
+//
+// The window must stay below the broker's max_replies_per_connection limit
+// (128 on the default system bus configuration), otherwise calls will fail.
+typedef struct {
+    scan_t          *scan;
+    introspect_cb_t  callback;
+    GQueue           pending;
+    guint            inflight;
+    guint            truncated;     // Paths not introspected because of introspect_max_paths.
+    GStringChunk    *paths;         // Every path queued, freed when the crawl finishes.
+} crawler_t;
+
+// When sampling, the first few siblings are queued and the rest are held
+// back until we know whether the samples all had the same shape.
+typedef struct {
+    guint            remaining;     // Samples not yet finished.
+    guint            depth;
+    guint64          shape;
+    gboolean         uniform;
+    const gchar     *sample;
+    GPtrArray       *deferred;
+} sibling_group_t;
+
+typedef struct {
+    gchar           *path;
+    guint            depth;
+    sibling_group_t *group;         // Set if this is a sample.
+} crawl_item_t;
+
+typedef struct {
+    crawler_t       *crawler;
+    crawl_item_t    *item;
+} crawl_request_t;
+
+static void crawl_send_pending(crawler_t *crawler);
+
+static void crawl_queue_path(crawler_t *crawler, const gchar *path, guint depth, sibling_group_t *group)
+{
+    crawl_item_t *item = g_new0(crawl_item_t, 1);
+
+    item->path  = g_string_chunk_insert(crawler->paths, path);
+    item->depth = depth;
+    item->group = group;
+
+    g_queue_push_tail(&crawler->pending, item);
+}
+
+static void crawl_queue_subpaths(crawler_t *crawler, GPtrArray *subpaths, guint depth)
+{
+    sibling_group_t *group = NULL;
+    guint i = 0;
+
+    if (should_sample_siblings(subpaths)) {
+        group               = g_new0(sibling_group_t, 1);
+        group->remaining    = introspect_sample_siblings;
+        group->depth        = depth;
+        group->uniform      = true;
+        group->deferred     = g_ptr_array_new();
+
+        for (; i < (guint) introspect_sample_siblings; i++) {
+            crawl_queue_path(crawler, g_ptr_array_index(subpaths, i), depth, group);
+        }
+
+        for (; i < subpaths->len; i++) {
+            g_ptr_array_add(group->deferred, g_string_chunk_insert(crawler->paths, g_ptr_array_index(subpaths, i)));
+        }
+    }
+
+    for (; i < subpaths->len; i++) {
+        crawl_queue_path(crawler, g_ptr_array_index(subpaths, i), depth, NULL);
+    }
+}
+
+// Called when a queued item has been visited, or failed.
+static void crawl_item_finished(crawler_t *crawler, crawl_item_t *item, guint64 shape)
+{
+    sibling_group_t *group = item->group;
+
+    if (group) {
+        if (shape == 0 || (group->sample && group->shape != shape)) {
+            group->uniform = false;
+        }
+
+        if (group->sample == NULL) {
+            group->shape    = shape;
+            group->sample   = item->path;
+        }
+
+        if (--group->remaining == 0) {
+            if (group->uniform) {
+                report_skipped_objects(crawler->scan, group->deferred, 0, group->sample);
+            } else {
+                for (guint i = 0; i < group->deferred->len; i++) {
+                    crawl_queue_path(crawler, g_ptr_array_index(group->deferred, i), group->depth, NULL);
+                }
+            }
+
+            g_ptr_array_unref(group->deferred);
+            g_free(group);
+        }
+    }
+
+    g_free(item);
+}
+
+// Visit a document and queue any subnodes.
+static guint64 crawl_visit(crawler_t *crawler, crawl_item_t *item, const gchar *xml)
+{
+    GPtrArray *subpaths = g_ptr_array_new_with_free_func(g_free);
+    GPtrArray *managed = g_ptr_array_new_with_free_func(g_free);
+    guint64 shape;
+
+    shape = visit_introspection_xml(crawler->scan, item->path, xml, item->depth, crawler->callback, subpaths, managed);
+
+    crawl_queue_subpaths(crawler, subpaths, item->depth + 1);
+
+    for (guint i = 0; i < managed->len; i++) {
+        const gchar *object = g_ptr_array_index(managed, i);
+        crawl_queue_path(crawler, object, item->depth + get_relative_depth(item->path, object), NULL);
+    }
+
+    g_ptr_array_unref(managed);
+    g_ptr_array_unref(subpaths);
+    return shape;
+}
+
+static void crawl_reply_ready(GObject *source, GAsyncResult *res, gpointer data)
+{
+    crawl_request_t *request = data;
+    crawler_t *crawler = request->crawler;
+    GDBusMessage *reply;
+    GVariant *body;
+    const gchar *xml;
+    guint64 shape = 0;
+
+    crawler->inflight--;
+
+    reply = g_dbus_scan_send_finish(G_DBUS_CONNECTION(source), res, NULL);
+
+    if (reply == NULL || g_dbus_message_get_message_type(reply) != G_DBUS_MESSAGE_TYPE_METHOD_RETURN) {
+        g_debug("failed to introspect %s @%s", crawler->scan->name, request->item->path);
+        goto finished;
+    }
+
+    body = g_dbus_message_get_body(reply);
+
+    if (g_strcmp0(g_variant_get_type_string(body), "(s)") != 0) {
+        g_debug("unexpected introspect reply type from %s", crawler->scan->name);
+        goto finished;
+    }
+
+    g_variant_get(body, "(&s)", &xml);
+
+    update_introspect_cache(crawler->scan->cache, request->item->path, xml);
+
+    shape = crawl_visit(crawler, request->item, xml);
+
+  finished:
+    if (reply)
+        g_object_unref(reply);
+    crawl_item_finished(crawler, request->item, shape);
+    g_free(request);
+    crawl_send_pending(crawler);
+}
+
+// Top up the window of outstanding Introspect calls from the pending queue.
+static void crawl_send_pending(crawler_t *crawler)
+{
+    while (crawler->inflight < (guint) introspect_pipeline && !g_queue_is_empty(&crawler->pending)) {
+        crawl_request_t *request;
+        GDBusMessage *message;
+        crawl_item_t *item;
+        gchar *xml;
+
+        item = g_queue_pop_head(&crawler->pending);
+
+        if (!g_variant_is_object_path(item->path)) {
+            g_debug("skipping invalid object path %s", item->path);
+            crawl_item_finished(crawler, item, 0);
+            continue;
+        }
+
+        if (!claim_walk_path(crawler->scan)) {
+            crawler->truncated++;
+            crawl_item_finished(crawler, item, 0);
+            continue;
+        }
+
+        // Cached nodes don't use a slot, their subnodes are just queued.
+        if ((xml = lookup_introspect_cache(crawler->scan->cache, item->path))) {
+            crawl_item_finished(crawler, item, crawl_visit(crawler, item, xml));
+            g_free(xml);
+            continue;
+        }
+
+        request             = g_new0(crawl_request_t, 1);
+        request->crawler    = crawler;
+        request->item       = item;
+
+        message = g_dbus_method(crawler->scan->name, item->path, "org.freedesktop.DBus.Introspectable", "Introspect");
+
+        crawler->inflight++;
+        g_dbus_scan_send_async(crawler->scan->bus, message, crawl_reply_ready, request);
+        g_object_unref(message);
+    }
+}
+
+// Like descend_introspection_nodes(), but keeps up to introspect_pipeline
+// requests in flight. The callback is invoked in reply order, not tree order.
+void crawl_introspection_nodes(scan_t *scan, const gchar *root, introspect_cb_t callback)
+{
+    GMainContext *context;
+    gint64 start = stats_start();
+    crawler_t crawler = {
+        .scan       = scan,
+        .callback   = callback,
+        .pending    = G_QUEUE_INIT,
+        .inflight   = 0,
+        .paths      = g_string_chunk_new(4096),
+    };
+
+    g_debug("crawling object paths in %s @%s, window %d", scan->name, root, introspect_pipeline);
+
+    // Replies are dispatched to the thread-default context at the time of the
+    // call, use a private one so that the polkit agent thread never sees them.
+    context = g_main_context_new();
+
+    g_main_context_push_thread_default(context);
+
+    crawl_queue_path(&crawler, root, 0, NULL);
+
+    crawl_send_pending(&crawler);
+
+    while (crawler.inflight > 0) {
+        g_main_context_iteration(context, true);
+    }
+
+    g_main_context_pop_thread_default(context);
+    g_main_context_unref(context);
+    g_string_chunk_free(crawler.paths);
+
+    if (crawler.truncated) {
+        report_truncated_objects(scan, root, "max-paths", crawler.truncated);
+    }
+
+    record_stats(STATS_WALK, get_service_key(scan->bus, scan->name), start, false);
+}
+
+// The serial walk is depth first, with an explicit stack of the nodes whose
+// children are still being visited, so deep trees can't exhaust the stack.
+// Each document is parsed and freed before its children are visited, so only
+// the paths of pending siblings are kept for each level.
+typedef struct {
+    GPtrArray   *subpaths;
+    guint        next;          // Index of the next child to visit.
+    guint        depth;         // Depth of the children.
+    gboolean     uniform;       // Every child so far had the same shape.
+    guint64      first;         // Shape of the first child.
+} descend_frame_t;
+
+static void free_descend_frame(descend_frame_t *frame)
+{
+    g_ptr_array_unref(frame->subpaths);
+    g_free(frame);
+}
+
+// Push a frame for subpaths at depth, taking ownership of subpaths.
+static void push_descend_frame(GQueue *stack, GPtrArray *subpaths, guint depth)
+{
+    descend_frame_t *frame;
+
+    if (subpaths->len == 0) {
+        g_ptr_array_unref(subpaths);
+        return;
+    }
+
+    frame           = g_new0(descend_frame_t, 1);
+    frame->subpaths = subpaths;
+    frame->depth    = depth;
+    frame->uniform  = true;
+
+    g_queue_push_head(stack, frame);
+}
+
+// Visit the node at path, and push a frame for its children, if it has any.
+// Objects listed by an ObjectManager at path each get a frame of their own, as
+// they can be at different depths.
+//
+// Returns the shape of the node, or 0 if it couldn't be introspected.
+static guint64 descend_node(scan_t *scan, GQueue *stack, const gchar *path, guint depth, introspect_cb_t callback)
+{
+    GPtrArray *subpaths;
+    GPtrArray *managed;
+    guint64 shape;
+    gchar *xml;
+
+    g_debug("searching for object paths in %s @%s", scan->name, path);
+
+    if (!(xml = get_name_introspect(scan, path))) {
+        g_debug("failed to introspect %s", scan->name);
+        return 0;
+    }
+
+    subpaths    = g_ptr_array_new_with_free_func(g_free);
+    managed     = g_ptr_array_new_with_free_func(g_free);
+    shape       = visit_introspection_xml(scan, path, xml, depth, callback, subpaths, managed);
+
     g_free(xml);
-    return;
+
+    push_descend_frame(stack, subpaths, depth + 1);
+
+    for (guint i = 0; i < managed->len; i++) {
+        GPtrArray *object = g_ptr_array_new_with_free_func(g_free);
+
+        g_ptr_array_add(object, g_strdup(g_ptr_array_index(managed, i)));
+        push_descend_frame(stack, object, depth + get_relative_depth(path, g_ptr_array_index(managed, i)));
+    }
+
+    g_ptr_array_unref(managed);
+    return shape;
 }
 
-#pragma GCC diagnostic pop
+void descend_introspection_nodes(scan_t *scan, const gchar *root, introspect_cb_t callback)
+{
+    GQueue stack = G_QUEUE_INIT;
+    descend_frame_t *frame;
+    gint64 start = stats_start();
+    guint truncated = 0;
+
+    if (claim_walk_path(scan)) {
+        descend_node(scan, &stack, root, 0, callback);
+    } else {
+        truncated++;
+    }
+
+    while ((frame = g_queue_peek_head(&stack))) {
+        const gchar *path;
+        guint64 child;
+
+        if (should_sample_siblings(frame->subpaths) && frame->next == (guint) introspect_sample_siblings && frame->uniform) {
+            report_skipped_objects(scan, frame->subpaths, frame->next, g_ptr_array_index(frame->subpaths, 0));
+            frame->next = frame->subpaths->len;
+        }
+
+        if (frame->next == frame->subpaths->len) {
+            free_descend_frame(g_queue_pop_head(&stack));
+            continue;
+        }
+
+        // Everything still on the stack is skipped.
+        if (!claim_walk_path(scan)) {
+            while ((frame = g_queue_pop_head(&stack))) {
+                truncated += frame->subpaths->len - frame->next;
+                free_descend_frame(frame);
+            }
+            break;
+        }
+
+        path = g_ptr_array_index(frame->subpaths, frame->next);
+
+        g_debug("discovered sub-path name %s", path);
+
+        // This pushes a frame for the children of path, if it has any.
+        child = descend_node(scan, &stack, path, frame->depth, callback);
+
+        if (child == 0 || (frame->next > 0 && child != frame->first)) {
+            frame->uniform = false;
+        }
+
+        if (frame->next++ == 0) {
+            frame->first = child;
+        }
+    }
+
+    if (truncated) {
+        report_truncated_objects(scan, root, "max-paths", truncated);
+    }
+
+    record_stats(STATS_WALK, get_service_key(scan->bus, scan->name), start, false);
+}
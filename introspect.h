@@ -1,10 +1,19 @@
 #ifndef __INTROSPECT_H
 #define __INTROSPECT_H
 
-typedef void (* introspect_cb_t)(xmlDocPtr doc, GDBusConnection *bus, const gchar *dest, const gchar *path, gpointer user);
+typedef void (* introspect_cb_t)(node_info_t *info, GDBusConnection *bus, const gchar *dest, const gchar *path, gpointer user);
+typedef void (* introspect_walk_t)(scan_t *scan, const gchar *root, introspect_cb_t callback);
 
-void descend_introspection_nodes(GDBusConnection *bus, gchar *name, const gchar *root, introspect_cb_t callback, gpointer user);
-void list_dbus_methods(xmlDocPtr doc, GDBusConnection *bus, const gchar *dest, const gchar *path, gpointer user);
-void list_dbus_properties(xmlDocPtr doc, GDBusConnection *bus, const gchar *dest, const gchar *path, gpointer user);
+void descend_introspection_nodes(scan_t *scan, const gchar *root, introspect_cb_t callback);
+void crawl_introspection_nodes(scan_t *scan, const gchar *root, introspect_cb_t callback);
+void list_dbus_methods(node_info_t *info, GDBusConnection *bus, const gchar *dest, const gchar *path, gpointer user);
+void list_dbus_properties(node_info_t *info, GDBusConnection *bus, const gchar *dest, const gchar *path, gpointer user);
+
+// Options
+extern gint introspect_pipeline;
+extern gint introspect_sample_siblings;
+extern gint introspect_max_depth;
+extern gint introspect_max_children;
+extern gint introspect_max_paths;
 
 #endif
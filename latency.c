@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+#include <gio/gio.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "latency.h"
+
+// With a fixed timeout, a single unresponsive service costs timeout * the
+// number of methods it exports. Instead, track the reply latency of each
+// destination and derive a timeout from it, the same way TCP estimates a
+// retransmission timeout (RFC 6298). Services that keep timing out are marked
+// degraded, and no more messages are sent to them.
+
+// Don't trust the estimate until we've seen a few replies.
+#define MIN_LATENCY_SAMPLES 3
+
+// Never wait less than this, in milliseconds. Even fast services are sometimes
+// slow to reply, e.g. while polkit asks for authorization.
+#define MIN_ADAPTIVE_TIMEOUT 250
+
+// Give up on a destination after this many timeouts in a row.
+#define MAX_CONSECUTIVE_TIMEOUTS 3
+
+// Options
+gboolean enable_adaptive_timeout;
+
+typedef struct {
+    gint64      srtt;           // Smoothed latency, in microseconds.
+    gint64      rttvar;         // Latency variation, in microseconds.
+    guint       samples;
+    guint       backoff;        // Timeout multiplier after a timeout.
+} estimate_t;
+
+// Introspect is usually answered by the binding without touching the service
+// logic, so it's much faster than a probe and gets its own estimate.
+typedef struct {
+    estimate_t  estimates[LATENCY_MAX];
+    guint       consecutive;    // Timeouts since the last reply.
+    guint       timeouts;
+    guint       skipped;
+    gboolean    degraded;
+} latency_t;
+
+static GHashTable *services;
+static GMutex services_lock;
+
+// Must be called with services_lock held.
+static latency_t * get_latency(const gchar *dest)
+{
+    latency_t *latency;
+
+    if (services == NULL) {
+        services = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    }
+
+    if (!(latency = g_hash_table_lookup(services, dest))) {
+        latency = g_new0(latency_t, 1);
+        for (guint i = 0; i < LATENCY_MAX; i++)
+            latency->estimates[i].backoff = 1;
+        g_hash_table_insert(services, g_strdup(dest), latency);
+    }
+
+    return latency;
+}
+
+// Decide which estimate a message is timed against.
+latency_class_t get_latency_class(GDBusMessage *msg)
+{
+    const gchar *interface = g_dbus_message_get_interface(msg);
+
+    if (g_strcmp0(g_dbus_message_get_destination(msg), "org.freedesktop.DBus") == 0)
+        return LATENCY_BUS;
+    if (g_strcmp0(interface, "org.freedesktop.DBus.Introspectable") == 0)
+        return LATENCY_INTROSPECT;
+    if (g_strcmp0(interface, "org.freedesktop.DBus.ObjectManager") == 0)
+        return LATENCY_INTROSPECT;
+
+    return LATENCY_PROBE;
+}
+
+// The bus itself answers every credential and name lookup, so it's never
+// degraded and always gets the full timeout.
+static gboolean is_adaptive(const gchar *dest, latency_class_t class)
+{
+    return enable_adaptive_timeout && dest != NULL && class != LATENCY_BUS;
+}
+
+// Return the timeout to use for the next call to dest, in milliseconds.
+gint get_service_timeout(const gchar *dest, latency_class_t class)
+{
+    estimate_t *estimate;
+    gint64 result;
+
+    if (!is_adaptive(dest, class) || timeout < 0) {
+        return timeout;
+    }
+
+    g_mutex_lock(&services_lock);
+
+    estimate = &get_latency(dest)->estimates[class];
+
+    if (estimate->samples < MIN_LATENCY_SAMPLES) {
+        result = timeout;
+    } else {
+        result = (estimate->srtt + 4 * estimate->rttvar) * estimate->backoff / 1000;
+        result = CLAMP(result, MIN(MIN_ADAPTIVE_TIMEOUT, timeout), timeout);
+    }
+
+    g_mutex_unlock(&services_lock);
+    return result;
+}
+
+gboolean is_service_degraded(const gchar *dest, latency_class_t class)
+{
+    gboolean result;
+
+    if (!is_adaptive(dest, class)) {
+        return false;
+    }
+
+    g_mutex_lock(&services_lock);
+    result = get_latency(dest)->degraded;
+    g_mutex_unlock(&services_lock);
+    return result;
+}
+
+// Record how long a call to dest took, in microseconds.
+void record_service_latency(const gchar *dest, latency_class_t class, gint64 elapsed, gboolean timedout)
+{
+    latency_t *latency;
+    estimate_t *estimate;
+
+    if (!is_adaptive(dest, class)) {
+        return;
+    }
+
+    g_mutex_lock(&services_lock);
+
+    latency  = get_latency(dest);
+    estimate = &latency->estimates[class];
+
+    if (timedout) {
+        latency->timeouts++;
+        estimate->backoff = MIN(estimate->backoff * 2, 64);
+
+        if (++latency->consecutive >= MAX_CONSECUTIVE_TIMEOUTS && !latency->degraded) {
+            g_debug("%s timed out %u times in a row, marking degraded", dest, latency->consecutive);
+            latency->degraded = true;
+        }
+    } else if (estimate->samples++ == 0) {
+        estimate->srtt       = elapsed;
+        estimate->rttvar     = elapsed / 2;
+        estimate->backoff    = 1;
+        latency->consecutive = 0;
+    } else {
+        estimate->rttvar     = (3 * estimate->rttvar + ABS(estimate->srtt - elapsed)) / 4;
+        estimate->srtt       = (7 * estimate->srtt + elapsed) / 8;
+        estimate->backoff    = 1;
+        latency->consecutive = 0;
+    }
+
+    g_mutex_unlock(&services_lock);
+}
+
+// Count a message that wasn't sent because dest is degraded.
+void record_service_skipped(const gchar *dest)
+{
+    g_mutex_lock(&services_lock);
+    get_latency(dest)->skipped++;
+    g_mutex_unlock(&services_lock);
+}
+
+void print_latency_summary(void)
+{
+    GHashTableIter iter;
+    gpointer dest;
+    gpointer value;
+
+    if (!enable_adaptive_timeout || services == NULL) {
+        return;
+    }
+
+    g_hash_table_iter_init(&iter, services);
+
+    while (g_hash_table_iter_next(&iter, &dest, &value)) {
+        latency_t *latency = value;
+
+        if (latency->degraded) {
+            g_printerr("%s: degraded after %u timeouts, %u calls skipped\n", (gchar *) dest, latency->timeouts, latency->skipped);
+        } else if (latency->timeouts) {
+            g_printerr("%s: %u calls timed out\n", (gchar *) dest, latency->timeouts);
+        }
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef __LATENCY_H
+#define __LATENCY_H
+
+// Replies are timed separately for each class of call.
+typedef enum {
+    LATENCY_BUS,            // Calls to the bus itself, never adapted.
+    LATENCY_INTROSPECT,     // Introspect and GetManagedObjects calls.
+    LATENCY_PROBE,          // Any other call, usually a probe.
+    LATENCY_MAX,
+} latency_class_t;
+
+latency_class_t get_latency_class(GDBusMessage *msg);
+gint get_service_timeout(const gchar *dest, latency_class_t class);
+gboolean is_service_degraded(const gchar *dest, latency_class_t class);
+void record_service_latency(const gchar *dest, latency_class_t class, gint64 elapsed, gboolean timedout);
+void record_service_skipped(const gchar *dest);
+void print_latency_summary(void);
+
+// Options
+extern gboolean enable_adaptive_timeout;
+
+#endif
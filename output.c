@@ -0,0 +1,479 @@
+#define _GNU_SOURCE
+#include <gio/gio.h>
+#include <proc/readproc.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "scan.h"
+#include "parser.h"
+#include "probes.h"
+#include "snapshot.h"
+#include "output.h"
+
+// All results are reported through here, either as the traditional
+// fixed-width table, or as JSON Lines for machine consumption.
+//
+// In JSON Lines mode, every record is a self-contained object written as soon
+// as it's discovered and flushed immediately, so that scans can be consumed
+// as a stream. Records from parallel workers may interleave, but each line
+// is written atomically and names the service it belongs to, and with
+// --address, the bus.
+
+// Options
+output_format_t output_format = OUTPUT_FORMAT_TEXT;
+
+gboolean parse_output_format(const gchar *name)
+{
+    if (g_strcmp0(name, "text") == 0) {
+        output_format = OUTPUT_FORMAT_TEXT;
+        return true;
+    }
+
+    if (g_strcmp0(name, "jsonl") == 0) {
+        output_format = OUTPUT_FORMAT_JSONL;
+        return true;
+    }
+
+    return false;
+}
+
+static void json_append_string(GString *json, const gchar *str)
+{
+    gchar *valid;
+
+    if (str == NULL) {
+        g_string_append(json, "null");
+        return;
+    }
+
+    // Names, paths and error messages come from the bus, and JSON must be
+    // UTF-8, so invalid sequences are replaced with U+FFFD.
+    valid = g_utf8_make_valid(str, -1);
+
+    g_string_append_c(json, '"');
+
+    for (const guchar *p = (const guchar *) valid; *p; p++) {
+        switch (*p) {
+            case '"':  g_string_append(json, "\\\""); break;
+            case '\\': g_string_append(json, "\\\\"); break;
+            case '\n': g_string_append(json, "\\n"); break;
+            case '\r': g_string_append(json, "\\r"); break;
+            case '\t': g_string_append(json, "\\t"); break;
+            default:
+                if (*p < 0x20) {
+                    g_string_append_printf(json, "\\u%04x", *p);
+                } else {
+                    g_string_append_c(json, *p);
+                }
+        }
+    }
+
+    g_string_append_c(json, '"');
+    g_free(valid);
+}
+
+// Start a record, must be followed by json_end_record().
+static GString * json_begin_record(const gchar *type)
+{
+    GString *json = g_string_new("{\"type\":");
+    json_append_string(json, type);
+    return json;
+}
+
+static void json_append_field(GString *json, const gchar *name, const gchar *value)
+{
+    g_string_append_c(json, ',');
+    json_append_string(json, name);
+    g_string_append_c(json, ':');
+    json_append_string(json, value);
+}
+
+// Start a record about scan, with the bus it came from if --address was used.
+static GString * json_begin_scan_record(scan_t *scan, const gchar *type)
+{
+    GString *json = json_begin_record(type);
+
+    if (scan->label) {
+        json_append_field(json, "bus", scan->label);
+    }
+
+    return json;
+}
+
+static void json_end_record(GString *json)
+{
+    g_string_append(json, "}\n");
+
+    // g_print() holds a lock, so lines from different threads don't mix.
+    g_print("%s", json->str);
+    fflush(stdout);
+    g_string_free(json, true);
+}
+
+void report_header(void)
+{
+    if (output_format == OUTPUT_FORMAT_TEXT) {
+        g_print("%s\t%16s\t%40s\t%32s\n", "PID", "USER", "NAME", "CMDLINE");
+    }
+}
+
+void report_service(scan_t *scan, proc_t *proc, gboolean protected)
+{
+    GString *json;
+
+    if (output_format == OUTPUT_FORMAT_TEXT) {
+        if (proc) {
+            scan_printf(scan, "%d\t%16s\t%40s%c\t%32s", proc->tid, proc->euser, scan->name, protected ? ' ' : '!', proc->cmdline[0]);
+            for (gint i = 1; proc->cmdline[i]; i++)
+                scan_printf(scan, " %s", proc->cmdline[i]);
+            scan_printf(scan, "\n");
+        } else {
+            scan_printf(scan, "%d\t%16s\t%40s%c\t%32s\n", -1, "unknown", scan->name, protected ? ' ' : '!', "");
+        }
+        return;
+    }
+
+    json = json_begin_scan_record(scan, "service");
+
+    json_append_field(json, "name", scan->name);
+
+    if (proc) {
+        g_string_append_printf(json, ",\"pid\":%d,\"uid\":%d", proc->tid, proc->euid);
+        json_append_field(json, "user", proc->euser);
+        g_string_append(json, ",\"cmdline\":[");
+        for (gint i = 0; proc->cmdline && proc->cmdline[i]; i++) {
+            if (i) g_string_append_c(json, ',');
+            json_append_string(json, proc->cmdline[i]);
+        }
+        g_string_append_c(json, ']');
+    } else {
+        g_string_append(json, ",\"pid\":null,\"uid\":null,\"user\":null,\"cmdline\":null");
+    }
+
+    // Name protection is only known if probes are enabled.
+    g_string_append_printf(json, ",\"protected\":%s", enable_access_probes ? (protected ? "true" : "false") : "null");
+
+    json_end_record(json);
+}
+
+// The name was activatable but not running, and was started by the scan.
+void report_activation(scan_t *scan)
+{
+    GString *json;
+
+    if (output_format == OUTPUT_FORMAT_TEXT) {
+        scan_printf(scan, "\t# %s was started by this scan\n", scan->name);
+        return;
+    }
+
+    json = json_begin_scan_record(scan, "activated");
+    json_append_field(json, "name", scan->name);
+    json_end_record(json);
+}
+
+static const gchar * access_to_str(property_access_t access)
+{
+    static const gchar * names[] = {
+        [PROPERTY_ACCESS_UNKNOWN]   = "unknown",
+        [PROPERTY_ACCESS_READ]      = "read",
+        [PROPERTY_ACCESS_WRITE]     = "write",
+        [PROPERTY_ACCESS_READWRITE] = "readwrite",
+    };
+
+    return names[access];
+}
+
+// Report a method ('m') or property ('p'). The text format only lists members
+// that don't appear to be denied or read-only, with the declared access of
+// properties. Members that weren't probed because the service stopped
+// responding are marked as skipped.
+void report_member(scan_t *scan, gchar kind, const gchar *path, const member_info_t *member, verdict_t verdict)
+{
+    const gchar *skipped;
+    GString *json;
+
+    snapshot_add_member(scan, kind, path, member, verdict);
+
+    if (output_format == OUTPUT_FORMAT_TEXT) {
+        if (verdict == VERDICT_DENIED || verdict == VERDICT_READONLY) {
+            return;
+        }
+
+        skipped = verdict == VERDICT_SKIPPED ? " [skipped]" : "";
+
+        if (kind == 'p' && member->access != PROPERTY_ACCESS_UNKNOWN) {
+            scan_printf(scan, "\t%c:%s.%s %s (%s)%s\n", kind, member->interface, member->name, path, access_to_str(member->access), skipped);
+        } else {
+            scan_printf(scan, "\t%c:%s.%s %s%s\n", kind, member->interface, member->name, path, skipped);
+        }
+        return;
+    }
+
+    json = json_begin_scan_record(scan, kind == 'm' ? "method" : "property");
+
+    json_append_field(json, "service", scan->name);
+    json_append_field(json, "path", path);
+    json_append_field(json, "interface", member->interface);
+    json_append_field(json, "member", member->name);
+    json_append_field(json, "signature", member->signature);
+
+    if (kind == 'p') {
+        json_append_field(json, "access", access_to_str(member->access));
+        g_string_append_printf(json, ",\"constant\":%s", member->constant ? "true" : "false");
+    }
+
+    json_append_field(json, "verdict", verdict_to_str(verdict));
+    json_end_record(json);
+}
+
+static void json_append_entry(GString *json, const gchar *name, const snapshot_entry_t *entry)
+{
+    g_string_append_printf(json, ",\"%s\":{\"path\":", name);
+    json_append_string(json, entry->path);
+    json_append_field(json, "signature", entry->signature);
+    if (entry->kind == 'p') {
+        json_append_field(json, "access", access_to_str(entry->access));
+    }
+    json_append_field(json, "verdict", verdict_to_str(entry->verdict));
+    g_string_append_c(json, '}');
+}
+
+// Report a difference between two snapshots, change is '+' for added, '-' for
+// removed or '~' for changed. Old or new is NULL if added or removed.
+void report_change(gchar change, const snapshot_entry_t *old, const snapshot_entry_t *new)
+{
+    const snapshot_entry_t *entry = new ? new : old;
+    GString *json;
+
+    if (output_format == OUTPUT_FORMAT_TEXT) {
+        g_print("%c %-40s %c:%s.%s %s", change, entry->service, entry->kind, entry->interface, entry->member, entry->path);
+
+        if (old && new) {
+            if (old->verdict != new->verdict)
+                g_print(" %s -> %s", verdict_to_str(old->verdict), verdict_to_str(new->verdict));
+            if (old->access != new->access)
+                g_print(" %s -> %s", access_to_str(old->access), access_to_str(new->access));
+            if (strcmp(old->signature, new->signature) != 0)
+                g_print(" (%s) -> (%s)", old->signature, new->signature);
+        } else {
+            g_print(" %s", verdict_to_str(entry->verdict));
+        }
+
+        g_print("\n");
+        return;
+    }
+
+    json = json_begin_record(change == '+' ? "added" : change == '-' ? "removed" : "changed");
+
+    json_append_field(json, "service", entry->service);
+    json_append_field(json, "kind", entry->kind == 'm' ? "method" : "property");
+    json_append_field(json, "interface", entry->interface);
+    json_append_field(json, "member", entry->member);
+
+    if (old) {
+        json_append_entry(json, "old", old);
+    }
+
+    if (new) {
+        json_append_entry(json, "new", new);
+    }
+
+    json_end_record(json);
+}
+
+// In watch mode, a member found by the previous scan of a name that is gone.
+// Key is the member as recorded by the scan, e.g. m:org.example.Iface.Method.
+void report_member_removed(scan_t *scan, const gchar *key)
+{
+    const gchar *member = strrchr(key, '.');
+    gchar *interface;
+    GString *json;
+
+    if (output_format == OUTPUT_FORMAT_TEXT) {
+        scan_printf(scan, "\t-%s\n", key);
+        return;
+    }
+
+    interface   = member ? g_strndup(key + 2, member - key - 2) : NULL;
+    json        = json_begin_scan_record(scan, *key == 'm' ? "method_removed" : "property_removed");
+
+    json_append_field(json, "service", scan->name);
+    json_append_field(json, "interface", interface);
+    json_append_field(json, "member", member ? member + 1 : key + 2);
+    json_end_record(json);
+    g_free(interface);
+}
+
+// In watch mode, an object announced that interfaces were added ('+') or
+// removed ('-').
+void report_object_change(scan_t *scan, gchar change, const gchar *path, const gchar **interfaces)
+{
+    GString *json;
+
+    if (output_format == OUTPUT_FORMAT_TEXT) {
+        scan_printf(scan, "\t%co:%s", change, path);
+        for (gint i = 0; interfaces && interfaces[i]; i++)
+            scan_printf(scan, "%c%s", i ? ',' : ' ', interfaces[i]);
+        scan_printf(scan, "\n");
+        return;
+    }
+
+    json = json_begin_scan_record(scan, change == '+' ? "object_added" : "object_removed");
+
+    json_append_field(json, "service", scan->name);
+    json_append_field(json, "path", path);
+    g_string_append(json, ",\"interfaces\":[");
+    for (gint i = 0; interfaces && interfaces[i]; i++) {
+        if (i) g_string_append_c(json, ',');
+        json_append_string(json, interfaces[i]);
+    }
+    g_string_append_c(json, ']');
+    json_end_record(json);
+}
+
+// In watch mode, a name was released by its owner.
+void report_service_removed(const gchar *name)
+{
+    GString *json;
+
+    if (output_format == OUTPUT_FORMAT_TEXT) {
+        g_print("%d\t%16s\t%40s-\t%32s\n", -1, "", name, "(released)");
+        return;
+    }
+
+    json = json_begin_record("service_removed");
+    json_append_field(json, "name", name);
+    json_end_record(json);
+}
+
+// Report sibling objects that were not introspected because they look like sample.
+void report_skipped_objects(scan_t *scan, GPtrArray *paths, guint start, const gchar *sample)
+{
+    for (guint i = start; i < paths->len; i++) {
+        GString *json;
+
+        if (output_format == OUTPUT_FORMAT_TEXT) {
+            scan_printf(scan, "\to:%s\n", (gchar *) g_ptr_array_index(paths, i));
+            continue;
+        }
+
+        json = json_begin_scan_record(scan, "object");
+        json_append_field(json, "service", scan->name);
+        json_append_field(json, "path", g_ptr_array_index(paths, i));
+        json_append_field(json, "sample", sample);
+        json_end_record(json);
+    }
+
+    if (output_format == OUTPUT_FORMAT_TEXT) {
+        scan_printf(scan, "\t# %u objects with the same interfaces as %s were not introspected\n", paths->len - start, sample);
+    }
+}
+
+// Report objects below path that were not walked because limit was reached.
+void report_truncated_objects(scan_t *scan, const gchar *path, const gchar *limit, guint count)
+{
+    GString *json;
+
+    if (output_format == OUTPUT_FORMAT_TEXT) {
+        scan_printf(scan, "\t# %u objects below %s were not introspected, --%s reached\n", count, path, limit);
+        return;
+    }
+
+    json = json_begin_scan_record(scan, "truncated");
+    json_append_field(json, "service", scan->name);
+    json_append_field(json, "path", path);
+    json_append_field(json, "limit", limit);
+    g_string_append_printf(json, ",\"count\":%u", count);
+    json_end_record(json);
+}
+
+// Summarise a bus before the results from it, if --address was used. Error is
+// set if it couldn't be scanned.
+void report_bus(const gchar *label, const gchar *address, guint names, const GError *error)
+{
+    GString *json;
+
+    if (output_format == OUTPUT_FORMAT_TEXT) {
+        if (error) {
+            g_print("# %s: %s\n", label, error->message);
+        } else {
+            g_print("# %s: %u names\n", label, names);
+        }
+        return;
+    }
+
+    json = json_begin_record("bus");
+    json_append_field(json, "bus", label);
+    json_append_field(json, "address", address);
+    g_string_append_printf(json, ",\"names\":%u", names);
+    json_append_field(json, "error", error ? error->message : NULL);
+    json_end_record(json);
+}
+
+void report_action_header(void)
+{
+    if (output_format == OUTPUT_FORMAT_TEXT) {
+        g_print("%-64s Any/Inactive/Active\n", "Action");
+    }
+}
+
+void report_action(const gchar *action, const gchar *any, const gchar *inactive, const gchar *active)
+{
+    GString *json;
+
+    if (output_format == OUTPUT_FORMAT_TEXT) {
+        g_print("%-64s %s/%s/%s\n", action, any, inactive, active);
+        return;
+    }
+
+    json = json_begin_record("action");
+    json_append_field(json, "action", action);
+    json_append_field(json, "any", any);
+    json_append_field(json, "inactive", inactive);
+    json_append_field(json, "active", active);
+    json_end_record(json);
+}
+
+// Subjects are columns, wide enough for their label.
+void report_authorization_header(const gchar **subjects)
+{
+    if (output_format != OUTPUT_FORMAT_TEXT) {
+        return;
+    }
+
+    g_print("%-64s", "Action");
+
+    for (const gchar **p = subjects; *p; p++) {
+        g_print(" %-*s", MAX((gint) strlen(*p), 5), *p);
+    }
+
+    g_print("\n");
+}
+
+void report_authorization(const gchar *action, const gchar **subjects, const gchar **results)
+{
+    GString *json;
+
+    if (output_format == OUTPUT_FORMAT_TEXT) {
+        g_print("%-64s", action);
+
+        for (guint i = 0; subjects[i]; i++) {
+            g_print(" %-*s", MAX((gint) strlen(subjects[i]), 5), results[i]);
+        }
+
+        g_print("\n");
+        return;
+    }
+
+    json = json_begin_record("authorization");
+    json_append_field(json, "action", action);
+
+    for (guint i = 0; subjects[i]; i++) {
+        json_append_field(json, subjects[i], results[i]);
+    }
+
+    json_end_record(json);
+}
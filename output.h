@@ -0,0 +1,29 @@
+#ifndef __OUTPUT_H
+#define __OUTPUT_H
+
+typedef enum {
+    OUTPUT_FORMAT_TEXT,
+    OUTPUT_FORMAT_JSONL,
+} output_format_t;
+
+gboolean parse_output_format(const gchar *name);
+void report_header(void);
+void report_service(scan_t *scan, proc_t *proc, gboolean protected);
+void report_activation(scan_t *scan);
+void report_member(scan_t *scan, gchar kind, const gchar *path, const member_info_t *member, verdict_t verdict);
+void report_member_removed(scan_t *scan, const gchar *key);
+void report_object_change(scan_t *scan, gchar change, const gchar *path, const gchar **interfaces);
+void report_service_removed(const gchar *name);
+void report_skipped_objects(scan_t *scan, GPtrArray *paths, guint start, const gchar *sample);
+void report_truncated_objects(scan_t *scan, const gchar *path, const gchar *limit, guint count);
+void report_bus(const gchar *label, const gchar *address, guint names, const GError *error);
+void report_action_header(void);
+void report_action(const gchar *action, const gchar *any, const gchar *inactive, const gchar *active);
+void report_authorization_header(const gchar **subjects);
+void report_authorization(const gchar *action, const gchar **subjects, const gchar **results);
+void report_change(gchar change, const snapshot_entry_t *old, const snapshot_entry_t *new);
+
+// Options
+extern output_format_t output_format;
+
+#endif
@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+#include <gio/gio.h>
+#include <libxml/parser.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parser.h"
+#include "stats.h"
+
+// I'm not particularly concerned about xmlChar vs char.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpointer-sign"
+
+// Introspection documents can be huge (systemd and NetworkManager are
+// hundreds of kilobytes), and we only need a handful of attributes from them.
+// Rather than building a DOM and querying it with XPath, this is a single
+// pass SAX parser that collects what we need into a node_info_t.
+//
+// Only these elements are interesting:
+//
+//  /node/node[@name]
+//  /node/interface[@name]
+//  /node/interface/method[@name]/arg[@type,@direction]
+//  /node/interface/property[@name,@type,@access]
+//  /node/interface/annotation[@name,@value]
+//  /node/interface/property/annotation[@name,@value]
+//
+// The only annotation used is EmitsChangedSignal, a value of const means the
+// property never changes, so there's no point trying to set it. On an
+// interface, it applies to the properties that follow.
+
+typedef struct {
+    node_info_t     *info;
+    guint            depth;
+    gboolean         root;          // Document element is a node.
+    const gchar     *interface;     // Current interface, if any.
+    gboolean         constant;      // Current interface is annotated const.
+    member_info_t    method;        // Current method, if any.
+    member_info_t   *property;      // Current property, if any.
+    GString         *signature;     // In-args of current method.
+} parse_state_t;
+
+// Find an attribute in the SAX2 attribute list. Values are not terminated,
+// so they're copied into the string chunk.
+static const gchar * get_attribute(GStringChunk *strings, const xmlChar **attributes, gint count, const gchar *name)
+{
+    for (gint i = 0; i < count; i++) {
+        const xmlChar **attribute = &attributes[i * 5];
+
+        if (g_strcmp0(attribute[0], name) == 0) {
+            return g_string_chunk_insert_len(strings, attribute[3], attribute[4] - attribute[3]);
+        }
+    }
+
+    return NULL;
+}
+
+// Like get_attribute(), but identical strings are only stored once. Interface
+// names and types are heavily repeated.
+static const gchar * get_attribute_const(GStringChunk *strings, const xmlChar **attributes, gint count, const gchar *name)
+{
+    for (gint i = 0; i < count; i++) {
+        const xmlChar **attribute = &attributes[i * 5];
+
+        if (g_strcmp0(attribute[0], name) == 0) {
+            gchar *value = g_strndup(attribute[3], attribute[4] - attribute[3]);
+            const gchar *result = g_string_chunk_insert_const(strings, value);
+            g_free(value);
+            return result;
+        }
+    }
+
+    return NULL;
+}
+
+static property_access_t parse_access(const gchar *access)
+{
+    if (g_strcmp0(access, "read") == 0)
+        return PROPERTY_ACCESS_READ;
+    if (g_strcmp0(access, "write") == 0)
+        return PROPERTY_ACCESS_WRITE;
+    if (g_strcmp0(access, "readwrite") == 0)
+        return PROPERTY_ACCESS_READWRITE;
+    return PROPERTY_ACCESS_UNKNOWN;
+}
+
+// If this is an EmitsChangedSignal annotation, set constant if the value is const.
+static void parse_annotation(GStringChunk *strings, const xmlChar **attributes, gint count, gboolean *constant)
+{
+    const gchar *name = get_attribute_const(strings, attributes, count, "name");
+
+    if (g_strcmp0(name, "org.freedesktop.DBus.Property.EmitsChangedSignal") == 0) {
+        *constant = g_strcmp0(get_attribute_const(strings, attributes, count, "value"), "const") == 0;
+    }
+}
+
+static void start_element(void *ctx,
+                          const xmlChar *localname,
+                          G_GNUC_UNUSED const xmlChar *prefix,
+                          G_GNUC_UNUSED const xmlChar *uri,
+                          G_GNUC_UNUSED gint nb_namespaces,
+                          G_GNUC_UNUSED const xmlChar **namespaces,
+                          gint nb_attributes,
+                          G_GNUC_UNUSED gint nb_defaulted,
+                          const xmlChar **attributes)
+{
+    parse_state_t *state = ctx;
+    node_info_t *info = state->info;
+
+    state->depth++;
+
+    if (state->depth == 1) {
+        state->root = g_strcmp0(localname, "node") == 0;
+    }
+
+    if (!state->root) {
+        return;
+    }
+
+    switch (state->depth) {
+        case 2:
+            if (g_strcmp0(localname, "node") == 0) {
+                const gchar *name = get_attribute(info->strings, attributes, nb_attributes, "name");
+                if (name) {
+                    g_ptr_array_add(info->nodes, (gpointer) name);
+                }
+            } else if (g_strcmp0(localname, "interface") == 0) {
+                state->interface = get_attribute_const(info->strings, attributes, nb_attributes, "name");
+                if (state->interface) {
+                    g_ptr_array_add(info->interfaces, (gpointer) state->interface);
+                }
+            }
+            break;
+        case 3:
+            if (state->interface == NULL)
+                break;
+
+            if (g_strcmp0(localname, "method") == 0) {
+                state->method.interface = state->interface;
+                state->method.name      = get_attribute(info->strings, attributes, nb_attributes, "name");
+                g_string_truncate(state->signature, 0);
+            } else if (g_strcmp0(localname, "property") == 0) {
+                member_info_t property = {
+                    .interface  = state->interface,
+                    .name       = get_attribute(info->strings, attributes, nb_attributes, "name"),
+                    .signature  = get_attribute_const(info->strings, attributes, nb_attributes, "type"),
+                    .access     = parse_access(get_attribute_const(info->strings, attributes, nb_attributes, "access")),
+                    .constant   = state->constant,
+                };
+                if (property.name) {
+                    g_array_append_val(info->properties, property);
+                    state->property = &g_array_index(info->properties, member_info_t, info->properties->len - 1);
+                }
+            } else if (g_strcmp0(localname, "annotation") == 0) {
+                parse_annotation(info->strings, attributes, nb_attributes, &state->constant);
+            }
+            break;
+        case 4:
+            if (state->method.name && g_strcmp0(localname, "arg") == 0) {
+                const gchar *direction = get_attribute_const(info->strings, attributes, nb_attributes, "direction");
+                const gchar *type = get_attribute_const(info->strings, attributes, nb_attributes, "type");
+
+                // The specification says direction defaults to in for methods.
+                if (type && g_strcmp0(direction, "out") != 0) {
+                    g_string_append(state->signature, type);
+                }
+            } else if (state->property && g_strcmp0(localname, "annotation") == 0) {
+                parse_annotation(info->strings, attributes, nb_attributes, &state->property->constant);
+            }
+            break;
+    }
+}
+
+static void end_element(void *ctx,
+                        const xmlChar *localname,
+                        G_GNUC_UNUSED const xmlChar *prefix,
+                        G_GNUC_UNUSED const xmlChar *uri)
+{
+    parse_state_t *state = ctx;
+
+    switch (state->depth) {
+        case 2:
+            state->interface = NULL;
+            state->constant  = false;
+            break;
+        case 3:
+            if (state->method.name && g_strcmp0(localname, "method") == 0) {
+                state->method.signature = g_string_chunk_insert_const(state->info->strings, state->signature->str);
+                g_array_append_val(state->info->methods, state->method);
+            }
+            memset(&state->method, 0, sizeof state->method);
+            state->property = NULL;
+            break;
+    }
+
+    state->depth--;
+}
+
+static void ignore_error(G_GNUC_UNUSED void *ctx, G_GNUC_UNUSED const char *msg, ...)
+{
+    return;
+}
+
+// Parse an introspection document.
+//
+// Returns NULL if the document is malformed, or a pointer that should be freed
+// with free_node_info().
+node_info_t * parse_node_info(const gchar *xml, gsize length)
+{
+    node_info_t *info;
+    gint64 start = stats_start();
+    parse_state_t state = {0};
+    xmlSAXHandler handler = {
+        .initialized    = XML_SAX2_MAGIC,
+        .startElementNs = start_element,
+        .endElementNs   = end_element,
+        .warning        = ignore_error,
+        .error          = ignore_error,
+        .fatalError     = ignore_error,
+    };
+
+    info                = g_new0(node_info_t, 1);
+    info->strings       = g_string_chunk_new(MAX(length / 4, 256));
+    info->interfaces    = g_ptr_array_new();
+    info->methods       = g_array_new(false, false, sizeof(member_info_t));
+    info->properties    = g_array_new(false, false, sizeof(member_info_t));
+    info->nodes         = g_ptr_array_new();
+    state.info          = info;
+    state.signature     = g_string_new(NULL);
+
+    if (xmlSAXUserParseMemory(&handler, &state, xml, length) != 0) {
+        g_string_free(state.signature, true);
+        free_node_info(info);
+        record_stats(STATS_PARSE, NULL, start, false);
+        return NULL;
+    }
+
+    g_string_free(state.signature, true);
+    record_stats(STATS_PARSE, NULL, start, false);
+    return info;
+}
+
+static guint64 hash_string(guint64 hash, const gchar *str)
+{
+    // FNV-1a, including the terminator so that "ab","c" != "a","bc".
+    do {
+        hash ^= (guchar) *str;
+        hash *= 0x100000001b3ULL;
+    } while (*str++);
+
+    return hash;
+}
+
+// Return a hash of the interfaces and members a node declares, so that objects
+// with identical interfaces can be recognised. Child node names are ignored,
+// only whether there are any.
+//
+// Never returns 0.
+guint64 get_node_shape(node_info_t *info)
+{
+    guint64 hash = 0xcbf29ce484222325ULL;
+
+    for (guint i = 0; i < info->interfaces->len; i++) {
+        hash = hash_string(hash, g_ptr_array_index(info->interfaces, i));
+    }
+
+    for (guint i = 0; i < info->methods->len; i++) {
+        member_info_t *method = &g_array_index(info->methods, member_info_t, i);
+        hash = hash_string(hash, method->interface);
+        hash = hash_string(hash, method->name);
+        hash = hash_string(hash, method->signature);
+    }
+
+    for (guint i = 0; i < info->properties->len; i++) {
+        member_info_t *property = &g_array_index(info->properties, member_info_t, i);
+        hash = hash_string(hash, property->interface);
+        hash = hash_string(hash, property->name);
+        hash = hash_string(hash, property->signature ? property->signature : "");
+        hash = (hash ^ property->access) * 0x100000001b3ULL;
+    }
+
+    hash = (hash ^ (info->nodes->len > 0)) * 0x100000001b3ULL;
+
+    return hash ? hash : 1;
+}
+
+void free_node_info(node_info_t *info)
+{
+    g_string_chunk_free(info->strings);
+    g_ptr_array_free(info->interfaces, true);
+    g_array_free(info->methods, true);
+    g_array_free(info->properties, true);
+    g_ptr_array_free(info->nodes, true);
+    g_free(info);
+}
+
+#pragma GCC diagnostic pop
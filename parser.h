@@ -0,0 +1,34 @@
+#ifndef __PARSER_H
+#define __PARSER_H
+
+// Declared access of a property.
+typedef enum {
+    PROPERTY_ACCESS_UNKNOWN     = 0,
+    PROPERTY_ACCESS_READ        = 1 << 0,
+    PROPERTY_ACCESS_WRITE       = 1 << 1,
+    PROPERTY_ACCESS_READWRITE   = PROPERTY_ACCESS_READ | PROPERTY_ACCESS_WRITE,
+} property_access_t;
+
+// A method or property. All strings are owned by the node_info_t.
+typedef struct {
+    const gchar         *interface;
+    const gchar         *name;
+    const gchar         *signature;     // Complete in-args for methods, type for properties.
+    property_access_t    access;        // Properties only.
+    gboolean             constant;      // Properties only, EmitsChangedSignal is const.
+} member_info_t;
+
+// Everything we need from an introspection document.
+typedef struct {
+    GStringChunk    *strings;
+    GPtrArray       *interfaces;    // const gchar *
+    GArray          *methods;       // member_info_t
+    GArray          *properties;    // member_info_t
+    GPtrArray       *nodes;         // const gchar *, relative names of subnodes
+} node_info_t;
+
+node_info_t * parse_node_info(const gchar *xml, gsize length);
+guint64 get_node_shape(node_info_t *info);
+void free_node_info(node_info_t *info);
+
+#endif
@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <gio/gio.h>
+#include <proc/readproc.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "peers.h"
+#include "stats.h"
+#include "trace.h"
+
+// Mapping names to processes used to cost a GetConnectionUnixProcessID round
+// trip and a full procps scan per name. Instead, GetConnectionCredentials is
+// sent for every name at once, and the results are joined against a single
+// pass over /proc that only reads the fields we print.
+//
+// With --replay, process details come from the trace instead of /proc.
+
+// Stay well below the broker's per-connection pending reply limit.
+#define MAX_PENDING_CREDENTIALS 64
+
+struct _peer_table {
+    GHashTable  *pids;      // name -> pid
+    GHashTable  *procs;     // pid -> proc_t
+    GMutex       lock;
+    gboolean     populated;
+};
+
+typedef struct {
+    GDBusConnection *bus;
+    peer_table_t    *table;
+    GPtrArray       *names;
+    guint            next;
+    guint            inflight;
+} credentials_batch_t;
+
+typedef struct {
+    credentials_batch_t *batch;
+    gchar               *name;
+} credentials_request_t;
+
+static void send_pending_credentials(credentials_batch_t *batch);
+
+static void credentials_ready(GObject *source, GAsyncResult *res, gpointer data)
+{
+    credentials_request_t *request = data;
+    GDBusMessage *reply;
+    GVariant *credentials;
+    guint32 pid;
+
+    reply = g_dbus_scan_send_finish(G_DBUS_CONNECTION(source), res, NULL);
+
+    request->batch->inflight--;
+
+    if (reply && g_dbus_message_get_message_type(reply) == G_DBUS_MESSAGE_TYPE_METHOD_RETURN
+              && g_strcmp0(g_variant_get_type_string(g_dbus_message_get_body(reply)), "(a{sv})") == 0) {
+        credentials = g_variant_get_child_value(g_dbus_message_get_body(reply), 0);
+
+        if (g_variant_lookup(credentials, "ProcessID", "u", &pid)) {
+            g_hash_table_insert(request->batch->table->pids, g_strdup(request->name), GUINT_TO_POINTER(pid));
+        }
+
+        g_variant_unref(credentials);
+    } else {
+        g_debug("no credentials available for %s", request->name);
+    }
+
+    if (reply)
+        g_object_unref(reply);
+
+    send_pending_credentials(request->batch);
+    g_free(request);
+}
+
+static void send_pending_credentials(credentials_batch_t *batch)
+{
+    while (batch->inflight < MAX_PENDING_CREDENTIALS && batch->next < batch->names->len) {
+        credentials_request_t *request = g_new0(credentials_request_t, 1);
+        GDBusMessage *message;
+
+        request->batch  = batch;
+        request->name   = g_ptr_array_index(batch->names, batch->next++);
+
+        message = g_dbus_method("org.freedesktop.DBus",
+                                "/org/freedesktop/DBus",
+                                "org.freedesktop.DBus",
+                                "GetConnectionCredentials");
+
+        g_dbus_message_set_body(message, g_variant_new("(s)", request->name));
+
+        batch->inflight++;
+        g_dbus_scan_send_async(batch->bus, message, credentials_ready, request);
+        g_object_unref(message);
+    }
+}
+
+static void free_replayed_process(gpointer data)
+{
+    proc_t *proc = data;
+
+    g_strfreev(proc->cmdline);
+    g_free(proc);
+}
+
+// Resolve the owning pid of every name in the list. Process details are not
+// read until the first call to get_peer_process().
+//
+// Returns a pointer that should be freed with free_peer_table().
+peer_table_t * get_peer_table(GDBusConnection *bus, GPtrArray *names)
+{
+    GMainContext *context;
+    peer_table_t *table;
+    gint64 start = stats_start();
+    credentials_batch_t batch = {
+        .bus        = bus,
+        .names      = names,
+        .next       = 0,
+        .inflight   = 0,
+    };
+
+    table           = g_new0(peer_table_t, 1);
+    table->pids     = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    table->procs    = g_hash_table_new_full(g_direct_hash,
+                                            g_direct_equal,
+                                            NULL,
+                                            trace_replay_file ? free_replayed_process : (GDestroyNotify) freeproc);
+    batch.table     = table;
+
+    g_mutex_init(&table->lock);
+
+    context = g_main_context_new();
+
+    g_main_context_push_thread_default(context);
+
+    send_pending_credentials(&batch);
+
+    while (batch.inflight > 0) {
+        g_main_context_iteration(context, true);
+    }
+
+    g_main_context_pop_thread_default(context);
+    g_main_context_unref(context);
+
+    g_debug("resolved credentials for %u of %u names", g_hash_table_size(table->pids), names->len);
+
+    record_stats(STATS_CREDENTIALS, NULL, start, false);
+    return table;
+}
+
+// Build the procps structure of every known pid from the trace, with only the
+// fields that were recorded.
+static void populate_replayed_processes(peer_table_t *table)
+{
+    GHashTableIter iter;
+    gpointer name;
+    gpointer pid;
+
+    g_hash_table_iter_init(&iter, table->pids);
+
+    while (g_hash_table_iter_next(&iter, &name, &pid)) {
+        GVariant *details = replay_process(name);
+        gchar *user;
+        proc_t *proc;
+
+        if (details == NULL) {
+            continue;
+        }
+
+        proc = g_new0(proc_t, 1);
+
+        g_variant_get(details, "(ius^as)", &proc->tid, &proc->euid, &user, &proc->cmdline);
+        g_strlcpy(proc->euser, user, sizeof proc->euser);
+        g_free(user);
+
+        g_hash_table_replace(table->procs, pid, proc);
+    }
+}
+
+// Read every known pid from /proc in one pass.
+static void populate_peer_processes(peer_table_t *table)
+{
+    GHashTableIter iter;
+    GHashTable *unique;
+    PROCTAB *proctab;
+    proc_t *proc;
+    pid_t *pidlist;
+    gpointer pid;
+    guint count = 0;
+    gint64 start = stats_start();
+
+    pidlist = g_new0(pid_t, g_hash_table_size(table->pids) + 1);
+    unique  = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    g_hash_table_iter_init(&iter, table->pids);
+
+    // Several names are often owned by the same process.
+    while (g_hash_table_iter_next(&iter, NULL, &pid)) {
+        if (g_hash_table_add(unique, pid)) {
+            pidlist[count++] = GPOINTER_TO_UINT(pid);
+        }
+    }
+
+    g_hash_table_destroy(unique);
+
+    proctab = openproc(PROC_FILLCOM | PROC_FILLUSR | PROC_FILLSTAT | PROC_PID, pidlist);
+
+    while ((proc = readproc(proctab, NULL))) {
+        g_hash_table_replace(table->procs, GINT_TO_POINTER(proc->tid), proc);
+    }
+
+    closeproc(proctab);
+    g_free(pidlist);
+
+    record_stats(STATS_PROCESSES, NULL, start, false);
+}
+
+// Return the procps structure for the owner of the specified name.
+//
+// Returns NULL if unknown, or a pointer owned by the table.
+proc_t * get_peer_process(peer_table_t *table, const gchar *name)
+{
+    gpointer pid;
+    proc_t *result = NULL;
+
+    g_mutex_lock(&table->lock);
+
+    if (!table->populated) {
+        if (trace_replay_file) {
+            populate_replayed_processes(table);
+        } else {
+            populate_peer_processes(table);
+        }
+        table->populated = true;
+    }
+
+    if (g_hash_table_lookup_extended(table->pids, name, NULL, &pid)) {
+        result = g_hash_table_lookup(table->procs, pid);
+    }
+
+    if (result && trace_record_file) {
+        record_process(name, g_variant_new("(ius^as)",
+                                           result->tid,
+                                           result->euid,
+                                           result->euser,
+                                           result->cmdline ? result->cmdline : (gchar *[]) { NULL }));
+    }
+
+    g_mutex_unlock(&table->lock);
+    return result;
+}
+
+// Return a string that changes whenever the owner of a name is restarted or
+// upgraded, made from the pid, process start time and executable mtime.
+//
+// Returns NULL if the owner is unknown, or a string you should free with g_free().
+gchar * get_peer_fingerprint(peer_table_t *table, const gchar *name)
+{
+    struct stat exe = {0};
+    gchar *filename;
+    proc_t *proc;
+
+    // The executable isn't on this host, and caches aren't used anyway.
+    if (trace_replay_file) {
+        return NULL;
+    }
+
+    if (!(proc = get_peer_process(table, name))) {
+        return NULL;
+    }
+
+    filename = g_strdup_printf("/proc/%d/exe", proc->tid);
+
+    if (stat(filename, &exe) != 0) {
+        g_debug("unable to stat %s, %m", filename);
+    }
+
+    g_free(filename);
+
+    return g_strdup_printf("%d:%llu:%ld.%09ld", proc->tid,
+                                                proc->start_time,
+                                                (long) exe.st_mtim.tv_sec,
+                                                (long) exe.st_mtim.tv_nsec);
+}
+
+void free_peer_table(peer_table_t *table)
+{
+    g_hash_table_destroy(table->pids);
+    g_hash_table_destroy(table->procs);
+    g_mutex_clear(&table->lock);
+    g_free(table);
+}
@@ -0,0 +1,11 @@
+#ifndef __PEERS_H
+#define __PEERS_H
+
+typedef struct _peer_table peer_table_t;
+
+peer_table_t * get_peer_table(GDBusConnection *bus, GPtrArray *names);
+proc_t * get_peer_process(peer_table_t *table, const gchar *name);
+gchar * get_peer_fingerprint(peer_table_t *table, const gchar *name);
+void free_peer_table(peer_table_t *table);
+
+#endif
@@ -7,27 +7,41 @@
 
 #include "util.h"
 #include "probes.h"
+#include "stats.h"
+#include "classify.h"
 
 gboolean enable_access_probes;
 
-// Call a remote method with invalid arguments and check whether the error
-// returned is access denied or invalid args. If it's the former, it's not very
-// interesting.
-gboolean check_access_method(GDBusConnection *bus, const gchar *dest, const gchar *path, const gchar *instance, const gchar *method, const gchar* sig)
+const gchar * verdict_to_str(verdict_t verdict)
+{
+    static const gchar * names[] = {
+        [VERDICT_UNPROBED]  = "unprobed",
+        [VERDICT_ALLOWED]   = "allowed",
+        [VERDICT_DENIED]    = "denied",
+        [VERDICT_NOREPLY]   = "noreply",
+        [VERDICT_UNKNOWN]   = "unknown",
+        [VERDICT_READONLY]  = "readonly",
+        [VERDICT_SKIPPED]   = "skipped",
+    };
+
+    g_return_val_if_fail(verdict < VERDICT_MAX, NULL);
+
+    return names[verdict];
+}
+
+static verdict_t probe_access_method(GDBusConnection *bus, const gchar *dest, const gchar *path, const gchar *instance, const gchar *method, const gchar* sig)
 {
     GDBusMessage *request;
     GDBusMessage *reply;
     gchar        *type;
     GError       *error = NULL;
-
-    if (!enable_access_probes)
-        return true;
+    verdict_t     verdict;
 
     request = g_dbus_message_new_method_call(dest, path, instance, method);
 
     g_dbus_message_set_body(request, build_invalid_body(sig));
 
-    reply = g_dbus_send(bus, request, G_DBUS_SEND_MESSAGE_FLAGS_NONE, timeout, NULL, NULL, &error);
+    reply = g_dbus_scan_send(bus, request, &error);
 
     if (reply == NULL) {
         g_assert_nonnull(error);
@@ -36,17 +50,20 @@ gboolean check_access_method(GDBusConnection *bus, const gchar *dest, const gcha
             g_debug("unexpected error domain %s", g_quark_to_string(error->domain));
         }
 
-        // Authentication timeout or peer crash.
+        // Authentication timeout or peer crash, unless --adaptive-timeout
+        // gave up on the service.
+        verdict = g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED) ? VERDICT_SKIPPED : VERDICT_NOREPLY;
+
         g_object_unref(request);
         g_error_free(error);
-        return true;
+        return verdict;
     }
 
     // Sometimes the parameters are not checked.
     if (g_dbus_message_get_message_type(reply) == G_DBUS_MESSAGE_TYPE_METHOD_RETURN) {
         g_object_unref(reply);
         g_object_unref(request);
-        return true;
+        return VERDICT_ALLOWED;
     }
 
     g_assert_cmpint(g_dbus_message_get_message_type(reply), ==, G_DBUS_MESSAGE_TYPE_ERROR);
@@ -56,30 +73,29 @@ gboolean check_access_method(GDBusConnection *bus, const gchar *dest, const gcha
     g_object_unref(reply);
     g_object_unref(request);
 
-    // Well, it didn't say not authorized, so that's a good sign.
-    if (g_strcmp0(type, "org.freedesktop.DBus.Python.ValueError") == 0)
-        return true;
-    if (g_strcmp0(type, "org.freedesktop.DBus.Error.InvalidArgs") == 0)
-        return true;
-    if (g_strcmp0(type, "org.freedesktop.DBus.Python.TypeError") == 0)
-        return true;
-    if (g_strcmp0(type, "org.freedesktop.DBus.Python.dbus.exceptions.DBusException") == 0)
-        return true;
+    // Well, if it didn't say not authorized, that's a good sign.
+    if ((verdict = classify_error(ERROR_CONTEXT_METHOD, type, dest)) == VERDICT_UNKNOWN)
+        g_debug("unknown method error string received `%s`", type);
 
-    // These are a pretty clear indication we dont have access.
-    if (g_strcmp0(type, "org.freedesktop.DBus.Error.UnknownMethod") == 0)
-        return false;
-    if (g_strcmp0(type, "org.freedesktop.DBus.Error.AccessDenied") == 0)
-        return false;
-    if (g_strcmp0(type, "org.freedesktop.PolicyKit.Error.NotAuthorized") == 0)
-        return false;
-    if (g_strstr_len(type, -1, "PolKit.NotAuthorizedException"))
-        return false;
-    if (g_strstr_len(type, -1, "authorization_2derror"))
-        return false;
+    return verdict;
+}
+
+// Call a remote method with invalid arguments and check whether the error
+// returned is access denied or invalid args. If it's the former, it's not very
+// interesting.
+verdict_t check_access_method(GDBusConnection *bus, const gchar *dest, const gchar *path, const gchar *instance, const gchar *method, const gchar* sig)
+{
+    verdict_t verdict;
+    gint64 start;
+
+    if (!enable_access_probes)
+        return VERDICT_UNPROBED;
 
-    g_debug("unknown method error string received `%s`", type);
-    return true;
+    start   = stats_start();
+    verdict = probe_access_method(bus, dest, path, instance, method, sig);
+
+    record_stats(STATS_METHOD_PROBE, get_service_key(bus, dest), start, verdict == VERDICT_NOREPLY);
+    return verdict;
 }
 
 gboolean check_name_protected(GDBusConnection *bus, const gchar *name)
@@ -87,6 +103,7 @@ gboolean check_name_protected(GDBusConnection *bus, const gchar *name)
     GDBusMessage *request;
     GDBusMessage *reply;
     gchar        *type;
+    verdict_t     verdict;
 
     if (!enable_access_probes)
         return true;
@@ -95,7 +112,12 @@ gboolean check_name_protected(GDBusConnection *bus, const gchar *name)
 
     g_dbus_message_set_body(request, g_variant_new ("(su)", name, 2));
 
-    reply = g_dbus_send(bus, request, G_DBUS_SEND_MESSAGE_FLAGS_NONE, timeout, NULL, NULL, NULL);
+    reply = g_dbus_scan_send(bus, request, NULL);
+
+    if (reply == NULL) {
+        g_object_unref(request);
+        return true;
+    }
 
     // Sometimes the parameters are not checked.
     if (g_dbus_message_get_message_type(reply) == G_DBUS_MESSAGE_TYPE_METHOD_RETURN) {
@@ -111,38 +133,73 @@ gboolean check_name_protected(GDBusConnection *bus, const gchar *name)
     g_object_unref(reply);
     g_object_unref(request);
 
-    if (g_strcmp0(type, "org.freedesktop.DBus.Error.AccessDenied") == 0)
-        return true;
-    if (g_strcmp0(type, "org.freedesktop.DBus.Error.InvalidArgs") == 0)
-        return true;
+    // Denied means the name is protected by policy.
+    if ((verdict = classify_error(ERROR_CONTEXT_NAME, type, name)) == VERDICT_UNKNOWN)
+        g_debug("unknown RequestName error string received `%s`", type);
 
-    g_print("Unknown Method Error String: %s\n", type);
-    return false;
+    return verdict == VERDICT_DENIED;
 }
 
-// Try to read the property, then set it to it's own value.
-/// If we can't read it, set it to "test" and see if it works.
-gboolean check_access_property(GDBusConnection *bus, const gchar *dest, const gchar *path, const gchar *instance, const gchar *property, const gchar* sig)
+// Read every property of an interface with one GetAll call, so that probing
+// each property doesn't need a separate Get.
+//
+// Returns NULL on error, or an a{sv} you should free with g_variant_unref().
+GVariant * get_all_properties(GDBusConnection *bus, const gchar *dest, const gchar *path, const gchar *instance)
+{
+    GDBusMessage *request;
+    GDBusMessage *reply;
+    GVariant     *body;
+    GVariant     *values = NULL;
+
+    request = g_dbus_message_new_method_call(dest, path, "org.freedesktop.DBus.Properties", "GetAll");
+
+    g_dbus_message_set_body(request, g_variant_new("(s)", instance));
+
+    reply = g_dbus_scan_send(bus, request, NULL);
+
+    // Errors are common, e.g. if reading requires authorization.
+    if (reply && g_dbus_message_get_message_type(reply) == G_DBUS_MESSAGE_TYPE_METHOD_RETURN) {
+        body = g_dbus_message_get_body(reply);
+
+        if (g_strcmp0(g_variant_get_type_string(body), "(a{sv})") == 0) {
+            values = g_variant_get_child_value(body, 0);
+        }
+    }
+
+    if (reply)
+        g_object_unref(reply);
+    g_object_unref(request);
+    return values;
+}
+
+static verdict_t probe_access_property(GDBusConnection *bus, const gchar *dest, const gchar *path, const gchar *instance, const gchar *property, const gchar* sig, gboolean readable, GVariant *values)
 {
     GDBusMessage *request;
     GDBusMessage *reply;
     GVariant     *body;
     GVariant     *test;
     gchar        *type;
-
-    if (!enable_access_probes)
-        return true;
+    GError       *error = NULL;
+    verdict_t     verdict;
 
     g_debug("testing access to property %s on %s", property, instance);
 
+    if (values || !readable) {
+        // Properties missing from GetAll probably can't be read anyway.
+        if (!values || !(body = g_variant_lookup_value(values, property, NULL))) {
+            body = g_variant_ref(build_invalid_body(sig));
+        }
+        goto set;
+    }
+
     request = g_dbus_message_new_method_call(dest, path, "org.freedesktop.DBus.Properties", "Get");
 
     // Read the current value
     g_dbus_message_set_body(request, g_variant_new ("(ss)", instance, property));
 
-    reply = g_dbus_send(bus, request, G_DBUS_SEND_MESSAGE_FLAGS_NONE, timeout, NULL, NULL, NULL);
+    reply = g_dbus_scan_send(bus, request, NULL);
 
-    if (g_dbus_message_get_message_type(reply) != G_DBUS_MESSAGE_TYPE_METHOD_RETURN) {
+    if (reply == NULL || g_dbus_message_get_message_type(reply) != G_DBUS_MESSAGE_TYPE_METHOD_RETURN) {
         body = build_invalid_body(sig);
         g_variant_ref(body);
     } else {
@@ -155,14 +212,26 @@ gboolean check_access_property(GDBusConnection *bus, const gchar *dest, const gc
         g_variant_ref(body);
     }
 
-    g_object_unref(reply);
+    if (reply)
+        g_object_unref(reply);
     g_object_unref(request);
 
+  set:
     request = g_dbus_message_new_method_call(dest, path, "org.freedesktop.DBus.Properties", "Set");
 
     g_dbus_message_set_body(request, g_variant_new("(ssv)", instance, property, body));
 
-    reply = g_dbus_send(bus, request, G_DBUS_SEND_MESSAGE_FLAGS_NONE, timeout, NULL, NULL, NULL);
+    reply = g_dbus_scan_send(bus, request, &error);
+
+    // Timeout or peer crash.
+    if (reply == NULL) {
+        verdict = g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED) ? VERDICT_SKIPPED : VERDICT_NOREPLY;
+
+        g_object_unref(request);
+        g_variant_unref(body);
+        g_error_free(error);
+        return verdict;
+    }
 
     if (g_dbus_message_get_message_type(reply) == G_DBUS_MESSAGE_TYPE_ERROR) {
 
@@ -172,35 +241,36 @@ gboolean check_access_property(GDBusConnection *bus, const gchar *dest, const gc
         g_object_unref(request);
         g_variant_unref(body);
 
-        // These are a good sign that we might be permitted to use this.
-        if (g_strcmp0(type, "org.freedesktop.DBus.Error.InvalidArgs") == 0)
-            return true;
-        if (g_strcmp0(type, "org.freedesktop.DBus.Error.NoReply") == 0)
-            return true;
-
-        if (g_strcmp0(type, "org.freedesktop.DBus.Error.AccessDenied") == 0)
-            return false;
-        if (g_strcmp0(type, "org.freedesktop.DBus.Error.PropertyReadOnly") == 0)
-            return false;
-        if (g_strcmp0(type, "org.freedesktop.PolicyKit.Error.NotAuthorized") == 0)
-            return false;
-        if (g_strcmp0(type, "org.freedesktop.DBus.Python.dbus.exceptions.DBusException") == 0)
-            return false;
-        if (g_strcmp0(type, "org.freedesktop.DBus.Error.UnknownMethod") == 0)
-            return false;
-        if (g_strcmp0(type, "org.freedesktop.DBus.Error.ServiceUnknown") == 0)
-            return false;
-        if (g_strstr_len(type, -1, "authorization_2derror"))
-            return false;
-
-        g_debug("unknown error string received `%s`", type);
-        return true;
+        if ((verdict = classify_error(ERROR_CONTEXT_PROPERTY, type, dest)) == VERDICT_UNKNOWN)
+            g_debug("unknown error string received `%s`", type);
+
+        return verdict;
     }
 
     g_object_unref(reply);
     g_object_unref(request);
     g_variant_unref(body);
 
-    return true;
+    return VERDICT_ALLOWED;
 }
 
+// Try to read the property, then set it to it's own value.
+/// If we can't read it, set it to "test" and see if it works.
+//
+// If values is not NULL, it's the result of get_all_properties() for this
+// interface and is used instead of reading the property again. Properties
+// declared write-only are not read at all.
+verdict_t check_access_property(GDBusConnection *bus, const gchar *dest, const gchar *path, const gchar *instance, const gchar *property, const gchar* sig, gboolean readable, GVariant *values)
+{
+    verdict_t verdict;
+    gint64 start;
+
+    if (!enable_access_probes)
+        return VERDICT_UNPROBED;
+
+    start   = stats_start();
+    verdict = probe_access_property(bus, dest, path, instance, property, sig, readable, values);
+
+    record_stats(STATS_PROPERTY_PROBE, get_service_key(bus, dest), start, verdict == VERDICT_NOREPLY);
+    return verdict;
+}
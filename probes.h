@@ -1,9 +1,23 @@
 #ifndef __PROBES_H
 #define __PROBES_H
 
-gboolean check_access_method(GDBusConnection *bus, const gchar *dest, const gchar *path, const gchar *instance, const gchar *method, const gchar* sig);
+// Result of probing a method or property.
+typedef enum {
+    VERDICT_UNPROBED,   // Probes are disabled.
+    VERDICT_ALLOWED,    // The error suggests we passed any access checks.
+    VERDICT_DENIED,     // The error suggests we're not authorized.
+    VERDICT_NOREPLY,    // Timeout or peer crash.
+    VERDICT_UNKNOWN,    // Unrecognised error.
+    VERDICT_READONLY,   // Property is declared read-only, so wasn't probed.
+    VERDICT_SKIPPED,    // Not sent, the service stopped responding.
+    VERDICT_MAX,
+} verdict_t;
+
+const gchar * verdict_to_str(verdict_t verdict);
+verdict_t check_access_method(GDBusConnection *bus, const gchar *dest, const gchar *path, const gchar *instance, const gchar *method, const gchar* sig);
 gboolean check_name_protected(GDBusConnection *bus, const gchar *name);
-gboolean check_access_property(GDBusConnection *bus, const gchar *dest, const gchar *path, const gchar *instance, const gchar *property, const gchar* sig);
+GVariant * get_all_properties(GDBusConnection *bus, const gchar *dest, const gchar *path, const gchar *instance);
+verdict_t check_access_property(GDBusConnection *bus, const gchar *dest, const gchar *path, const gchar *instance, const gchar *property, const gchar* sig, gboolean readable, GVariant *values);
 
 // Options
 extern gboolean enable_access_probes;
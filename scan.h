@@ -0,0 +1,28 @@
+#ifndef __SCAN_H
+#define __SCAN_H
+
+// State for scanning a single D-Bus name. This is passed as the user pointer
+// to introspection callbacks.
+typedef struct {
+    GDBusConnection *bus;
+    gchar           *name;
+    const gchar     *label;     // The bus this name is on, if --address was used.
+    struct _peer_table *peers;  // Owners of the names on this bus, shared by every scan.
+    gchar           *fingerprint;   // Identifies the owner process, if known.
+    GHashTable      *members;   // Symbols of methods and properties already reported.
+    struct _introspect_cache *cache;
+    GString         *output;    // If not NULL, output is buffered here.
+    gboolean         done;      // Set by worker threads when complete.
+    gboolean         activatable;   // Activatable, but not running when listed.
+    GHashTable      *verdicts;  // If not NULL, the verdict of each member found, by symbol.
+    GHashTable      *previous;  // If not NULL, only report members that differ from this.
+    GPtrArray       *managers;  // Paths of ObjectManagers that have listed their objects.
+    GHashTable      *managed;   // Paths those ObjectManagers listed.
+    guint            walked;    // Objects introspected, see introspect_max_paths.
+} scan_t;
+
+scan_t * new_scan(GDBusConnection *bus, const gchar *name);
+void free_scan(scan_t *scan);
+void scan_printf(scan_t *scan, const gchar *format, ...) G_GNUC_PRINTF(2, 3);
+
+#endif
@@ -0,0 +1,319 @@
+#define _GNU_SOURCE
+#include <gio/gio.h>
+#include <proc/readproc.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "scan.h"
+#include "parser.h"
+#include "probes.h"
+#include "snapshot.h"
+#include "output.h"
+#include "symbols.h"
+
+// A snapshot is a compact record of every method and property found during a
+// scan, so that results from different days or hosts can be compared.
+//
+// The file is a serialized GVariant of type (uxasa(uyuuuuyy)), containing a
+// version, the time of the scan, a sorted string table, and one fixed-size
+// record per member, made of string indexes, the kind, verdict and access.
+//
+// Because the string table is sorted, ordering records by string index also
+// orders them by name, so the records are sorted by (service, kind,
+// interface, member) and two snapshots can be compared in a single merge pass
+// over the mapped files, without parsing or allocating anything per record.
+
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_FILE_TYPE "(uxasa(uyuuuuyy))"
+#define SNAPSHOT_RECORD_TYPE "(uyuuuuyy)"
+
+// Options
+gchar *snapshot_file;
+
+static GHashTable *strings;         // Interned strings used by entries.
+static GArray *entries;
+static GMutex snapshot_lock;
+
+// Strings are interned, so the set of strings used is keyed by pointer.
+static const gchar * intern_snapshot_string(const gchar *str)
+{
+    const gchar *interned = symbol_to_str(intern_symbol(str ? str : ""));
+
+    g_hash_table_add(strings, (gpointer) interned);
+    return interned;
+}
+
+// Remember a member for the snapshot, does nothing unless --snapshot is used.
+void snapshot_add_member(scan_t *scan, gchar kind, const gchar *path, const member_info_t *member, verdict_t verdict)
+{
+    snapshot_entry_t entry;
+    gchar *service = NULL;
+
+    if (snapshot_file == NULL) {
+        return;
+    }
+
+    g_mutex_lock(&snapshot_lock);
+
+    if (strings == NULL) {
+        strings = g_hash_table_new(g_direct_hash, g_direct_equal);
+        entries = g_array_new(false, false, sizeof(snapshot_entry_t));
+    }
+
+    // Names on different buses are different services.
+    if (scan->label) {
+        service = g_strdup_printf("%s:%s", scan->label, scan->name);
+    }
+
+    entry.service   = intern_snapshot_string(service ? service : scan->name);
+    entry.interface = intern_snapshot_string(member->interface);
+    entry.member    = intern_snapshot_string(member->name);
+    entry.path      = intern_snapshot_string(path);
+    entry.signature = intern_snapshot_string(member->signature);
+    entry.kind      = kind;
+    entry.verdict   = verdict;
+    entry.access    = member->access;
+
+    g_array_append_val(entries, entry);
+    g_mutex_unlock(&snapshot_lock);
+    g_free(service);
+}
+
+static gint compare_strings(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const gchar **) a, *(const gchar **) b);
+}
+
+// Order entries by (service, kind, interface, member), this must match the
+// order of the records in the file.
+static gint compare_entries(const snapshot_entry_t *a, const snapshot_entry_t *b)
+{
+    gint result;
+
+    if ((result = strcmp(a->service, b->service)))
+        return result;
+    if (a->kind != b->kind)
+        return a->kind - b->kind;
+    if ((result = strcmp(a->interface, b->interface)))
+        return result;
+    return strcmp(a->member, b->member);
+}
+
+gboolean save_snapshot(const gchar *filename)
+{
+    GVariantBuilder builder;
+    GHashTable *index;
+    GVariant *contents;
+    GError *error = NULL;
+    gpointer *table;
+    gboolean result;
+    guint count;
+
+    if (strings == NULL) {
+        strings = g_hash_table_new(g_direct_hash, g_direct_equal);
+        entries = g_array_new(false, false, sizeof(snapshot_entry_t));
+    }
+
+    table   = g_hash_table_get_keys_as_array(strings, &count);
+    index   = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    qsort(table, count, sizeof(gpointer), compare_strings);
+    g_array_sort(entries, (GCompareFunc) compare_entries);
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE(SNAPSHOT_FILE_TYPE));
+    g_variant_builder_add(&builder, "u", SNAPSHOT_VERSION);
+    g_variant_builder_add(&builder, "x", g_get_real_time());
+    g_variant_builder_open(&builder, G_VARIANT_TYPE("as"));
+
+    for (guint i = 0; i < count; i++) {
+        g_hash_table_insert(index, table[i], GUINT_TO_POINTER(i));
+        g_variant_builder_add(&builder, "s", table[i]);
+    }
+
+    g_variant_builder_close(&builder);
+    g_variant_builder_open(&builder, G_VARIANT_TYPE("a" SNAPSHOT_RECORD_TYPE));
+
+    for (guint i = 0; i < entries->len; i++) {
+        snapshot_entry_t *entry = &g_array_index(entries, snapshot_entry_t, i);
+
+        g_variant_builder_add(&builder, SNAPSHOT_RECORD_TYPE,
+                              GPOINTER_TO_UINT(g_hash_table_lookup(index, entry->service)),
+                              entry->kind,
+                              GPOINTER_TO_UINT(g_hash_table_lookup(index, entry->interface)),
+                              GPOINTER_TO_UINT(g_hash_table_lookup(index, entry->member)),
+                              GPOINTER_TO_UINT(g_hash_table_lookup(index, entry->path)),
+                              GPOINTER_TO_UINT(g_hash_table_lookup(index, entry->signature)),
+                              entry->verdict,
+                              entry->access);
+    }
+
+    g_variant_builder_close(&builder);
+
+    contents = g_variant_ref_sink(g_variant_builder_end(&builder));
+    result   = g_file_set_contents(filename, g_variant_get_data(contents), g_variant_get_size(contents), &error);
+
+    if (!result) {
+        g_warning("failed to write snapshot %s, %s", filename, error->message);
+        g_error_free(error);
+    }
+
+    g_variant_unref(contents);
+    g_hash_table_destroy(index);
+    g_hash_table_destroy(strings);
+    g_array_free(entries, true);
+    g_free(table);
+
+    strings = NULL;
+    entries = NULL;
+    return result;
+}
+
+typedef struct {
+    GMappedFile *file;
+    GVariant    *contents;
+    GVariant    *records;
+    const gchar **strings;
+    gsize        nstrings;
+    gsize        nrecords;
+} snapshot_t;
+
+static void close_snapshot(snapshot_t *snapshot)
+{
+    if (snapshot->records)
+        g_variant_unref(snapshot->records);
+    if (snapshot->contents)
+        g_variant_unref(snapshot->contents);
+    if (snapshot->file)
+        g_mapped_file_unref(snapshot->file);
+    g_free(snapshot->strings);
+}
+
+static gboolean open_snapshot(const gchar *filename, snapshot_t *snapshot)
+{
+    GVariant *table;
+    GError *error = NULL;
+    GBytes *bytes;
+    guint32 version;
+
+    memset(snapshot, 0, sizeof *snapshot);
+
+    if (!(snapshot->file = g_mapped_file_new(filename, false, &error))) {
+        g_warning("failed to open snapshot %s, %s", filename, error->message);
+        g_error_free(error);
+        return false;
+    }
+
+    bytes = g_mapped_file_get_bytes(snapshot->file);
+    snapshot->contents = g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE(SNAPSHOT_FILE_TYPE), bytes, false));
+    g_bytes_unref(bytes);
+
+    g_variant_get_child(snapshot->contents, 0, "u", &version);
+
+    if (version != SNAPSHOT_VERSION) {
+        g_warning("snapshot %s has unsupported version %u", filename, version);
+        close_snapshot(snapshot);
+        return false;
+    }
+
+    // The string pointers refer directly to the mapped file.
+    table               = g_variant_get_child_value(snapshot->contents, 2);
+    snapshot->strings   = g_variant_get_strv(table, &snapshot->nstrings);
+    snapshot->records   = g_variant_get_child_value(snapshot->contents, 3);
+    snapshot->nrecords  = g_variant_n_children(snapshot->records);
+
+    g_variant_unref(table);
+    return true;
+}
+
+// Read a record, the file is untrusted so the indexes must be checked.
+static gboolean get_snapshot_entry(snapshot_t *snapshot, gsize i, snapshot_entry_t *entry)
+{
+    guint32 service, interface, member, path, signature;
+    guint8 kind, verdict, access;
+
+    g_variant_get_child(snapshot->records, i, SNAPSHOT_RECORD_TYPE, &service, &kind, &interface, &member, &path, &signature, &verdict, &access);
+
+    if (service >= snapshot->nstrings
+     || interface >= snapshot->nstrings
+     || member >= snapshot->nstrings
+     || path >= snapshot->nstrings
+     || signature >= snapshot->nstrings) {
+        return false;
+    }
+
+    entry->service      = snapshot->strings[service];
+    entry->interface    = snapshot->strings[interface];
+    entry->member       = snapshot->strings[member];
+    entry->path         = snapshot->strings[path];
+    entry->signature    = snapshot->strings[signature];
+    entry->kind         = kind;
+    entry->verdict      = verdict < VERDICT_MAX ? verdict : VERDICT_UNKNOWN;
+    entry->access       = access <= PROPERTY_ACCESS_READWRITE ? access : PROPERTY_ACCESS_UNKNOWN;
+    return true;
+}
+
+// Compare two snapshots, and report every member that was added, removed, or
+// has a different verdict, signature or access.
+gboolean diff_snapshots(const gchar *oldname, const gchar *newname)
+{
+    snapshot_t old;
+    snapshot_t new;
+    snapshot_entry_t a;
+    snapshot_entry_t b;
+    gsize i = 0;
+    gsize j = 0;
+
+    if (!open_snapshot(oldname, &old)) {
+        return false;
+    }
+
+    if (!open_snapshot(newname, &new)) {
+        close_snapshot(&old);
+        return false;
+    }
+
+    while (i < old.nrecords || j < new.nrecords) {
+        gint order;
+
+        if (i < old.nrecords && !get_snapshot_entry(&old, i, &a)) {
+            g_warning("snapshot %s is corrupt at record %" G_GSIZE_FORMAT, oldname, i);
+            break;
+        }
+
+        if (j < new.nrecords && !get_snapshot_entry(&new, j, &b)) {
+            g_warning("snapshot %s is corrupt at record %" G_GSIZE_FORMAT, newname, j);
+            break;
+        }
+
+        if (i == old.nrecords) {
+            order = 1;
+        } else if (j == new.nrecords) {
+            order = -1;
+        } else {
+            order = compare_entries(&a, &b);
+        }
+
+        if (order < 0) {
+            report_change('-', &a, NULL);
+            i++;
+        } else if (order > 0) {
+            report_change('+', NULL, &b);
+            j++;
+        } else {
+            if (a.verdict != b.verdict
+             || a.access != b.access
+             || strcmp(a.signature, b.signature) != 0) {
+                report_change('~', &a, &b);
+            }
+            i++;
+            j++;
+        }
+    }
+
+    close_snapshot(&old);
+    close_snapshot(&new);
+    return i == old.nrecords && j == new.nrecords;
+}
@@ -0,0 +1,23 @@
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+// A single method or property as recorded in a snapshot.
+typedef struct {
+    const gchar *service;
+    const gchar *interface;
+    const gchar *member;
+    const gchar *path;
+    const gchar *signature;
+    gchar        kind;      // 'm' or 'p'
+    verdict_t    verdict;
+    property_access_t access;
+} snapshot_entry_t;
+
+void snapshot_add_member(scan_t *scan, gchar kind, const gchar *path, const member_info_t *member, verdict_t verdict);
+gboolean save_snapshot(const gchar *filename);
+gboolean diff_snapshots(const gchar *oldname, const gchar *newname);
+
+// Options
+extern gchar *snapshot_file;
+
+#endif
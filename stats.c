@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+#include <gio/gio.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "stats.h"
+#include "symbols.h"
+
+// With --stats, each phase of a scan is timed and a summary is printed to
+// stderr when the scan finishes. When the option is off, stats_start() returns
+// 0 without reading the clock, and record_stats() returns immediately.
+//
+// Latencies are kept in a log-linear histogram with 8 buckets per power of
+// two, so percentiles are accurate to within about 12% and memory use is
+// fixed regardless of the number of samples.
+
+#define HISTOGRAM_SUB_BITS  3
+#define HISTOGRAM_BUCKETS   ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+// How many services to list in the summary.
+#define SLOWEST_SERVICES    10
+
+// Options
+gboolean enable_stats;
+
+typedef struct {
+    guint64     count;
+    guint64     timeouts;
+    gint64      total;          // Microseconds.
+    gint64      max;
+    guint64     histogram[HISTOGRAM_BUCKETS];
+} phase_stats_t;
+
+typedef struct {
+    const gchar *name;
+    gint64      elapsed;        // Time spent scanning it, in microseconds.
+    guint64     calls;
+    guint64     timeouts;
+    gint64      total;          // Time spent waiting for it to reply.
+} service_stats_t;
+
+static const gchar * phase_names[] = {
+    [STATS_CREDENTIALS]     = "credentials",
+    [STATS_PROCESSES]       = "processes",
+    [STATS_SERVICE]         = "service",
+    [STATS_WALK]            = "walk",
+    [STATS_PARSE]           = "parse",
+    [STATS_METHOD_PROBE]    = "method-probe",
+    [STATS_PROPERTY_PROBE]  = "property-probe",
+    [STATS_BUS_CALL]        = "bus-call",
+    [STATS_INTROSPECT_CALL] = "introspect-call",
+    [STATS_PROPERTY_CALL]   = "property-call",
+    [STATS_METHOD_CALL]     = "method-call",
+};
+
+static phase_stats_t phases[STATS_MAX];
+static GHashTable *services;
+static GMutex stats_lock;
+
+static guint histogram_bucket(guint64 value)
+{
+    guint exponent;
+
+    if (value < (1 << HISTOGRAM_SUB_BITS)) {
+        return value;
+    }
+
+    exponent = g_bit_storage(value) - 1;
+
+    return ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+         + ((value >> (exponent - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1));
+}
+
+// The largest value that would be counted in bucket.
+static guint64 histogram_bucket_limit(guint bucket)
+{
+    guint exponent;
+    guint64 mantissa;
+
+    if (bucket < (1 << HISTOGRAM_SUB_BITS)) {
+        return bucket;
+    }
+
+    exponent = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    mantissa = (bucket & ((1 << HISTOGRAM_SUB_BITS) - 1)) | (1 << HISTOGRAM_SUB_BITS);
+
+    return ((mantissa + 1) << (exponent - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+static gint64 get_percentile(phase_stats_t *phase, gdouble percentile)
+{
+    guint64 target = MAX(1, (guint64) (phase->count * percentile + 0.5));
+    guint64 seen = 0;
+
+    for (guint i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if ((seen += phase->histogram[i]) >= target) {
+            return MIN((gint64) histogram_bucket_limit(i), phase->max);
+        }
+    }
+
+    return phase->max;
+}
+
+// Returns a timestamp to pass to record_stats(), or 0 if stats are disabled.
+gint64 stats_start(void)
+{
+    return enable_stats ? g_get_monotonic_time() : 0;
+}
+
+// Decide which phase a message belongs to.
+stats_phase_t get_call_phase(GDBusMessage *msg)
+{
+    const gchar *interface;
+
+    if (!enable_stats) {
+        return STATS_METHOD_CALL;
+    }
+
+    interface = g_dbus_message_get_interface(msg);
+
+    if (g_strcmp0(g_dbus_message_get_destination(msg), "org.freedesktop.DBus") == 0)
+        return STATS_BUS_CALL;
+    if (g_strcmp0(interface, "org.freedesktop.DBus.Introspectable") == 0)
+        return STATS_INTROSPECT_CALL;
+    if (g_strcmp0(interface, "org.freedesktop.DBus.ObjectManager") == 0)
+        return STATS_INTROSPECT_CALL;
+    if (g_strcmp0(interface, "org.freedesktop.DBus.Properties") == 0)
+        return STATS_PROPERTY_CALL;
+
+    return STATS_METHOD_CALL;
+}
+
+// Record the time since start against phase. Calls and service scans are also
+// counted against service, if it's not NULL.
+void record_stats(stats_phase_t phase, const gchar *service, gint64 start, gboolean timedout)
+{
+    service_stats_t *stats;
+    gint64 elapsed;
+
+    if (!enable_stats || start == 0) {
+        return;
+    }
+
+    g_return_if_fail(phase < STATS_MAX);
+
+    elapsed = MAX(0, g_get_monotonic_time() - start);
+
+    g_mutex_lock(&stats_lock);
+
+    phases[phase].count++;
+    phases[phase].timeouts += timedout;
+    phases[phase].total += elapsed;
+    phases[phase].max = MAX(phases[phase].max, elapsed);
+    phases[phase].histogram[histogram_bucket(elapsed)]++;
+
+    if (service && (phase == STATS_SERVICE || phase >= STATS_BUS_CALL)) {
+        if (services == NULL) {
+            services = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+        }
+
+        if (!(stats = g_hash_table_lookup(services, service))) {
+            stats = g_new0(service_stats_t, 1);
+            stats->name = g_intern_string(service);
+            g_hash_table_insert(services, (gpointer) stats->name, stats);
+        }
+
+        if (phase == STATS_SERVICE) {
+            stats->elapsed += elapsed;
+        } else {
+            stats->calls++;
+            stats->timeouts += timedout;
+            stats->total += elapsed;
+        }
+    }
+
+    g_mutex_unlock(&stats_lock);
+}
+
+static const gchar * format_duration(gchar *buffer, gsize size, gint64 usec)
+{
+    if (usec < 1000) {
+        g_snprintf(buffer, size, "%" G_GINT64_FORMAT "us", usec);
+    } else if (usec < G_USEC_PER_SEC) {
+        g_snprintf(buffer, size, "%.1fms", usec / 1000.);
+    } else {
+        g_snprintf(buffer, size, "%.2fs", usec / (gdouble) G_USEC_PER_SEC);
+    }
+
+    return buffer;
+}
+
+static gint compare_service_elapsed(gconstpointer a, gconstpointer b)
+{
+    const service_stats_t *x = *(service_stats_t **) a;
+    const service_stats_t *y = *(service_stats_t **) b;
+
+    if (x->elapsed != y->elapsed)
+        return x->elapsed < y->elapsed ? 1 : -1;
+    if (x->total != y->total)
+        return x->total < y->total ? 1 : -1;
+
+    return g_strcmp0(x->name, y->name);
+}
+
+// The peak RSS of the whole process, and how much of it is interned strings.
+static void print_memory_summary(void)
+{
+    struct rusage usage;
+    guint symbols;
+    gsize bytes;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return;
+    }
+
+    get_symbol_usage(&symbols, &bytes);
+
+    g_printerr("\n%-16s %10ld KiB\n", "PEAK RSS", usage.ru_maxrss);
+    g_printerr("%-16s %10u (%" G_GSIZE_FORMAT " KiB)\n", "SYMBOLS", symbols, bytes / 1024);
+}
+
+void print_stats_summary(void)
+{
+    GHashTableIter iter;
+    GPtrArray *sorted;
+    gpointer value;
+    gchar total[32], p50[32], p99[32], max[32], elapsed[32];
+
+    if (!enable_stats) {
+        return;
+    }
+
+    g_printerr("%-16s %10s %10s %10s %10s %10s %9s\n", "PHASE", "COUNT", "TOTAL", "P50", "P99", "MAX", "TIMEOUTS");
+
+    for (guint i = 0; i < STATS_MAX; i++) {
+        phase_stats_t *phase = &phases[i];
+
+        if (phase->count == 0) {
+            continue;
+        }
+
+        g_printerr("%-16s %10" G_GUINT64_FORMAT " %10s %10s %10s %10s %9" G_GUINT64_FORMAT "\n",
+                   phase_names[i],
+                   phase->count,
+                   format_duration(total, sizeof total, phase->total),
+                   format_duration(p50, sizeof p50, get_percentile(phase, 0.50)),
+                   format_duration(p99, sizeof p99, get_percentile(phase, 0.99)),
+                   format_duration(max, sizeof max, phase->max),
+                   phase->timeouts);
+    }
+
+    print_memory_summary();
+
+    if (services == NULL) {
+        return;
+    }
+
+    sorted = g_ptr_array_new();
+
+    g_hash_table_iter_init(&iter, services);
+
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        g_ptr_array_add(sorted, value);
+    }
+
+    g_ptr_array_sort(sorted, compare_service_elapsed);
+
+    g_printerr("\n%-40s %10s %10s %10s %9s\n", "SLOWEST SERVICES", "SCAN", "CALLS", "WAITING", "TIMEOUTS");
+
+    for (guint i = 0; i < MIN(sorted->len, SLOWEST_SERVICES); i++) {
+        service_stats_t *service = g_ptr_array_index(sorted, i);
+
+        g_printerr("%-40s %10s %10" G_GUINT64_FORMAT " %10s %9" G_GUINT64_FORMAT "\n",
+                   service->name,
+                   format_duration(elapsed, sizeof elapsed, service->elapsed),
+                   service->calls,
+                   format_duration(total, sizeof total, service->total),
+                   service->timeouts);
+    }
+
+    g_ptr_array_free(sorted, true);
+}
@@ -0,0 +1,29 @@
+#ifndef __STATS_H
+#define __STATS_H
+
+// Parts of a scan that are timed with --stats. Phases nest, e.g. a method
+// probe includes the method call it sends.
+typedef enum {
+    STATS_CREDENTIALS,      // Resolving the owner of every name.
+    STATS_PROCESSES,        // Reading process details from /proc.
+    STATS_SERVICE,          // Scanning one service, start to finish.
+    STATS_WALK,             // Walking one object tree, including probes.
+    STATS_PARSE,            // Parsing one introspection document.
+    STATS_METHOD_PROBE,     // Probing one method.
+    STATS_PROPERTY_PROBE,   // Probing one property.
+    STATS_BUS_CALL,         // Calls to the bus itself.
+    STATS_INTROSPECT_CALL,  // Introspect and GetManagedObjects calls.
+    STATS_PROPERTY_CALL,    // Get, GetAll and Set calls.
+    STATS_METHOD_CALL,      // Any other call, usually a method probe.
+    STATS_MAX,
+} stats_phase_t;
+
+gint64 stats_start(void);
+stats_phase_t get_call_phase(GDBusMessage *msg);
+void record_stats(stats_phase_t phase, const gchar *service, gint64 start, gboolean timedout);
+void print_stats_summary(void);
+
+// Options
+extern gboolean enable_stats;
+
+#endif
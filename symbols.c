@@ -0,0 +1,112 @@
+#define _GNU_SOURCE
+#include <gio/gio.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "symbols.h"
+
+// Interface names, member names, signatures and paths are repeated across
+// thousands of objects and every service that implements the standard
+// interfaces. Each distinct string is stored once, in an arena that lives
+// until exit, and is identified by a small integer, so that sets of members
+// can be keyed by symbol without allocating or hashing strings.
+//
+// Lookups only take a read lock, so workers rarely contend once the common
+// names have been seen.
+
+// Most strings are short, so this is a few hundred names per block.
+#define SYMBOL_CHUNK_SIZE 16384
+
+// The longest interface or member name D-Bus allows.
+#define MAX_NAME_LENGTH 255
+
+static GRWLock symbol_lock;
+static GHashTable *symbols;         // String -> symbol
+static GPtrArray *names;            // Symbol -> string, 0 is unused.
+static GStringChunk *arena;
+static gsize arena_bytes;
+
+symbol_t intern_symbol(const gchar *str)
+{
+    gpointer symbol;
+    gchar *interned;
+
+    g_return_val_if_fail(str != NULL, 0);
+
+    g_rw_lock_reader_lock(&symbol_lock);
+    symbol = symbols ? g_hash_table_lookup(symbols, str) : NULL;
+    g_rw_lock_reader_unlock(&symbol_lock);
+
+    if (symbol) {
+        return GPOINTER_TO_UINT(symbol);
+    }
+
+    g_rw_lock_writer_lock(&symbol_lock);
+
+    if (symbols == NULL) {
+        symbols = g_hash_table_new(g_str_hash, g_str_equal);
+        names   = g_ptr_array_new();
+        arena   = g_string_chunk_new(SYMBOL_CHUNK_SIZE);
+
+        g_ptr_array_add(names, NULL);
+    }
+
+    // Another thread might have added it while we waited.
+    if (!(symbol = g_hash_table_lookup(symbols, str))) {
+        interned = g_string_chunk_insert(arena, str);
+        symbol   = GUINT_TO_POINTER(names->len);
+
+        g_ptr_array_add(names, interned);
+        g_hash_table_insert(symbols, interned, symbol);
+
+        arena_bytes += strlen(str) + 1;
+    }
+
+    g_rw_lock_writer_unlock(&symbol_lock);
+    return GPOINTER_TO_UINT(symbol);
+}
+
+// The string is valid until exit.
+const gchar * symbol_to_str(symbol_t symbol)
+{
+    const gchar *str;
+
+    g_return_val_if_fail(symbol != 0, NULL);
+
+    g_rw_lock_reader_lock(&symbol_lock);
+    str = names && symbol < names->len ? g_ptr_array_index(names, symbol) : NULL;
+    g_rw_lock_reader_unlock(&symbol_lock);
+    return str;
+}
+
+// The symbol for a member key like "m:interface.name", as used in watch mode.
+// The key is built on the stack, so nothing is allocated for members we've
+// already seen.
+symbol_t intern_member(gchar kind, const gchar *interface, const gchar *name)
+{
+    gchar key[2 + MAX_NAME_LENGTH + 1 + MAX_NAME_LENGTH + 1];
+    gchar *dynamic = NULL;
+    symbol_t symbol;
+
+    // Names from introspection data aren't validated, so they might not fit.
+    if (g_snprintf(key, sizeof key, "%c:%s.%s", kind, interface, name) >= (gint) sizeof key) {
+        dynamic = g_strdup_printf("%c:%s.%s", kind, interface, name);
+    }
+
+    symbol = intern_symbol(dynamic ? dynamic : key);
+
+    g_free(dynamic);
+    return symbol;
+}
+
+void get_symbol_usage(guint *count, gsize *bytes)
+{
+    g_rw_lock_reader_lock(&symbol_lock);
+
+    *count = names ? names->len - 1 : 0;
+    *bytes = arena_bytes;
+
+    g_rw_lock_reader_unlock(&symbol_lock);
+}
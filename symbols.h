@@ -0,0 +1,12 @@
+#ifndef __SYMBOLS_H
+#define __SYMBOLS_H
+
+// An interned string, 0 is never a valid symbol.
+typedef guint32 symbol_t;
+
+symbol_t intern_symbol(const gchar *str);
+const gchar * symbol_to_str(symbol_t symbol);
+symbol_t intern_member(gchar kind, const gchar *interface, const gchar *name);
+void get_symbol_usage(guint *count, gsize *bytes);
+
+#endif
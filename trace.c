@@ -0,0 +1,419 @@
+#define _GNU_SOURCE
+#include <gio/gio.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "probes.h"
+#include "trace.h"
+#include "verdicts.h"
+
+// With --record, every request sent by g_dbus_scan_send() and the reply it got
+// is saved to a trace file. With --replay, replies are served from the trace
+// instead of the bus, so a scan can be repeated offline, e.g. to test changes
+// to the parser or probe classifiers against the same inputs.
+//
+// The file is a serialized GVariant of type (uxsa{s(iusas)}ava(sysui)),
+// containing a version, the time it was recorded, the caller identity used
+// for cached verdicts, the process that owned each name, a table of unique
+// reply bodies, and one record per exchange, in the order they were sent:
+//
+//  s   The request, as destination, path, interface.member and arguments.
+//  y   The reply type, or 0 if there was no reply.
+//  s   The error name, for error replies.
+//  u   Index of the reply body, or G_MAXUINT32 if it was empty.
+//  i   The GIOErrorEnum code, if there was no reply.
+//
+// Introspection data for similar objects and most error replies are
+// identical, so sharing bodies keeps traces small.
+//
+// A request can be sent more than once, e.g. reading a property and then
+// setting it. Identical requests are replayed in the order they were recorded,
+// and the last reply is repeated if there are more requests than replies.
+//
+// Process details are replayed from the trace too, so a trace shows the same
+// owners on any host.
+
+#define TRACE_VERSION 2
+#define TRACE_FILE_TYPE "(uxsa{s" TRACE_PROCESS_TYPE "}ava(sysui))"
+#define TRACE_RECORD_TYPE "(sysui)"
+#define TRACE_NO_BODY G_MAXUINT32
+
+// Options
+gchar *trace_record_file;
+gchar *trace_replay_file;
+
+static GMutex trace_lock;
+
+// Recording.
+static GVariantBuilder *records;
+static GPtrArray *bodies;
+static GHashTable *body_index;      // Serialized body -> index + 1
+static GHashTable *processes;       // Name -> process details
+
+// Replaying.
+static GVariant *trace;
+static GVariant *replay_bodies;
+static GVariant *replay_records;
+static GHashTable *requests;        // Request -> GQueue of record indexes
+static GHashTable *replay_processes; // Name -> process details
+
+// Returns a string you should free with g_free().
+static gchar * get_request_key(GDBusMessage *request)
+{
+    GVariant *body = g_dbus_message_get_body(request);
+    gchar *args = body ? g_variant_print(body, true) : g_strdup("()");
+    gchar *key;
+
+    key = g_strdup_printf("%s %s %s.%s %s",
+                          g_dbus_message_get_destination(request),
+                          g_dbus_message_get_path(request),
+                          g_dbus_message_get_interface(request),
+                          g_dbus_message_get_member(request),
+                          args);
+
+    g_free(args);
+    return key;
+}
+
+// Must be called with trace_lock held.
+static guint32 add_trace_body(GVariant *body)
+{
+    GVariant *boxed;
+    GBytes *bytes;
+    gpointer index;
+
+    if (body == NULL) {
+        return TRACE_NO_BODY;
+    }
+
+    // The type is part of the serialized variant, so (s) "a" and (o) "/a"
+    // are different keys.
+    boxed = g_variant_ref_sink(g_variant_new_variant(body));
+    bytes = g_variant_get_data_as_bytes(boxed);
+
+    if ((index = g_hash_table_lookup(body_index, bytes))) {
+        g_bytes_unref(bytes);
+    } else {
+        g_ptr_array_add(bodies, g_variant_ref(body));
+        index = GUINT_TO_POINTER(bodies->len);
+        g_hash_table_insert(body_index, bytes, index);
+    }
+
+    g_variant_unref(boxed);
+    return GPOINTER_TO_UINT(index) - 1;
+}
+
+// Must be called with trace_lock held.
+static void init_trace_recording(void)
+{
+    if (records) {
+        return;
+    }
+
+    records     = g_variant_builder_new(G_VARIANT_TYPE("a" TRACE_RECORD_TYPE));
+    bodies      = g_ptr_array_new_with_free_func((GDestroyNotify) g_variant_unref);
+    body_index  = g_hash_table_new_full(g_bytes_hash, g_bytes_equal, (GDestroyNotify) g_bytes_unref, NULL);
+    processes   = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_variant_unref);
+}
+
+// Save a request and its reply, does nothing unless --record is used.
+void record_message(GDBusMessage *request, GDBusMessage *reply, const GError *error)
+{
+    const gchar *error_name = NULL;
+    gchar *key;
+    gint32 code = -1;
+
+    if (trace_record_file == NULL || request == NULL) {
+        return;
+    }
+
+    if (reply == NULL) {
+        code = error && error->domain == G_IO_ERROR ? error->code : G_IO_ERROR_FAILED;
+    } else if (g_dbus_message_get_message_type(reply) == G_DBUS_MESSAGE_TYPE_ERROR) {
+        error_name = g_dbus_message_get_error_name(reply);
+    }
+
+    key = get_request_key(request);
+
+    g_mutex_lock(&trace_lock);
+
+    init_trace_recording();
+
+    g_variant_builder_add(records, TRACE_RECORD_TYPE,
+                          key,
+                          reply ? g_dbus_message_get_message_type(reply) : 0,
+                          error_name ? error_name : "",
+                          add_trace_body(reply ? g_dbus_message_get_body(reply) : NULL),
+                          code);
+
+    g_mutex_unlock(&trace_lock);
+    g_free(key);
+}
+
+// Save the process that owns name, details is a floating or owned
+// TRACE_PROCESS_TYPE. Does nothing unless --record is used.
+void record_process(const gchar *name, GVariant *details)
+{
+    g_variant_ref_sink(details);
+
+    if (trace_record_file) {
+        g_mutex_lock(&trace_lock);
+        init_trace_recording();
+        g_hash_table_replace(processes, g_strdup(name), g_variant_ref(details));
+        g_mutex_unlock(&trace_lock);
+    }
+
+    g_variant_unref(details);
+}
+
+gboolean save_trace(const gchar *filename)
+{
+    GVariantBuilder builder;
+    GHashTableIter iter;
+    GVariant *contents;
+    GError *error = NULL;
+    gpointer name;
+    gpointer details;
+    gchar *caller;
+    gboolean result;
+
+    caller = get_caller_identity();
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE(TRACE_FILE_TYPE));
+    g_variant_builder_add(&builder, "u", TRACE_VERSION);
+    g_variant_builder_add(&builder, "x", g_get_real_time());
+    g_variant_builder_add(&builder, "s", caller);
+    g_variant_builder_open(&builder, G_VARIANT_TYPE("a{s" TRACE_PROCESS_TYPE "}"));
+
+    if (processes) {
+        g_hash_table_iter_init(&iter, processes);
+
+        while (g_hash_table_iter_next(&iter, &name, &details)) {
+            g_variant_builder_add(&builder, "{s@" TRACE_PROCESS_TYPE "}", name, details);
+        }
+    }
+
+    g_variant_builder_close(&builder);
+    g_variant_builder_open(&builder, G_VARIANT_TYPE("av"));
+
+    for (guint i = 0; bodies && i < bodies->len; i++) {
+        g_variant_builder_add(&builder, "v", g_ptr_array_index(bodies, i));
+    }
+
+    g_variant_builder_close(&builder);
+
+    if (records) {
+        g_variant_builder_add_value(&builder, g_variant_builder_end(records));
+    } else {
+        g_variant_builder_add_value(&builder, g_variant_new_array(G_VARIANT_TYPE(TRACE_RECORD_TYPE), NULL, 0));
+    }
+
+    contents = g_variant_ref_sink(g_variant_builder_end(&builder));
+    result   = g_file_set_contents(filename, g_variant_get_data(contents), g_variant_get_size(contents), &error);
+
+    if (!result) {
+        g_warning("failed to write trace %s, %s", filename, error->message);
+        g_error_free(error);
+    }
+
+    g_variant_unref(contents);
+    g_free(caller);
+
+    if (records) {
+        g_variant_builder_unref(records);
+        g_ptr_array_unref(bodies);
+        g_hash_table_destroy(body_index);
+        g_hash_table_destroy(processes);
+    }
+
+    records     = NULL;
+    bodies      = NULL;
+    body_index  = NULL;
+    processes   = NULL;
+    return result;
+}
+
+// Map a trace for replay_message(), the file stays mapped until exit.
+gboolean load_trace(const gchar *filename)
+{
+    GMappedFile *file;
+    GVariantIter iter;
+    GVariant *owners;
+    GVariant *details;
+    GError *error = NULL;
+    GBytes *bytes;
+    const gchar *caller;
+    const gchar *name;
+    guint32 version;
+    gsize count;
+
+    if (!(file = g_mapped_file_new(filename, false, &error))) {
+        g_warning("failed to open trace %s, %s", filename, error->message);
+        g_error_free(error);
+        return false;
+    }
+
+    bytes = g_mapped_file_get_bytes(file);
+    trace = g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE(TRACE_FILE_TYPE), bytes, false));
+    g_bytes_unref(bytes);
+    g_mapped_file_unref(file);
+
+    g_variant_get_child(trace, 0, "u", &version);
+
+    if (version != TRACE_VERSION) {
+        g_warning("trace %s has unsupported version %u", filename, version);
+        g_variant_unref(trace);
+        trace = NULL;
+        return false;
+    }
+
+    replay_bodies       = g_variant_get_child_value(trace, 4);
+    replay_records      = g_variant_get_child_value(trace, 5);
+    requests            = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify) g_queue_free);
+    replay_processes    = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify) g_variant_unref);
+    count               = g_variant_n_children(replay_records);
+
+    // Verdicts depend on who ran the scan, so say whose view this is.
+    g_variant_get_child(trace, 2, "&s", &caller);
+    g_message("replaying a scan recorded as caller %s", caller);
+
+    // Names point into the mapped file.
+    owners = g_variant_get_child_value(trace, 3);
+    g_variant_iter_init(&iter, owners);
+
+    while (g_variant_iter_next(&iter, "{&s@" TRACE_PROCESS_TYPE "}", &name, &details)) {
+        g_hash_table_replace(replay_processes, (gpointer) name, details);
+    }
+
+    g_variant_unref(owners);
+
+    for (gsize i = 0; i < count; i++) {
+        const gchar *key;
+        GQueue *queue;
+
+        // The key points into the mapped file.
+        g_variant_get_child(replay_records, i, "(&sy&sui)", &key, NULL, NULL, NULL, NULL);
+
+        if (!(queue = g_hash_table_lookup(requests, key))) {
+            queue = g_queue_new();
+            g_hash_table_insert(requests, (gpointer) key, queue);
+        }
+
+        g_queue_push_tail(queue, GSIZE_TO_POINTER(i));
+    }
+
+    g_debug("loaded %" G_GSIZE_FORMAT " recorded requests from %s", count, filename);
+    return true;
+}
+
+// Build the reply to request from a trace record. The file is untrusted, so
+// anything that GDBus would reject is treated as corrupt.
+static GDBusMessage * build_replay_message(GDBusMessage *request, GVariant *record, GError **error)
+{
+    GDBusMessage *reply;
+    GVariant *body = NULL;
+    const gchar *error_name;
+    guint8 type;
+    guint32 index;
+    gint32 code;
+
+    g_variant_get(record, "(&sy&sui)", NULL, &type, &error_name, &index, &code);
+
+    if (type == 0) {
+        g_set_error(error, G_IO_ERROR, code, "recorded error replayed from trace");
+        return NULL;
+    }
+
+    if (index != TRACE_NO_BODY) {
+        if (index >= g_variant_n_children(replay_bodies)) {
+            goto corrupt;
+        }
+
+        g_variant_get_child(replay_bodies, index, "v", &body);
+
+        if (!g_variant_is_of_type(body, G_VARIANT_TYPE_TUPLE)) {
+            goto corrupt;
+        }
+    }
+
+    if (type != G_DBUS_MESSAGE_TYPE_METHOD_RETURN && type != G_DBUS_MESSAGE_TYPE_ERROR) {
+        goto corrupt;
+    }
+
+    if (type == G_DBUS_MESSAGE_TYPE_ERROR && !g_dbus_is_interface_name(error_name)) {
+        goto corrupt;
+    }
+
+    // The request was never sent, so it doesn't have a serial to reply to.
+    reply = g_dbus_message_new();
+
+    g_dbus_message_set_message_type(reply, type);
+    g_dbus_message_set_reply_serial(reply, g_dbus_message_get_serial(request));
+    g_dbus_message_set_body(reply, body);
+
+    if (type == G_DBUS_MESSAGE_TYPE_ERROR) {
+        g_dbus_message_set_error_name(reply, error_name);
+    }
+
+    if (body)
+        g_variant_unref(body);
+
+    return reply;
+
+  corrupt:
+    if (body)
+        g_variant_unref(body);
+
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "trace %s is corrupt", trace_replay_file);
+    return NULL;
+}
+
+// Find the recorded owner of name in the trace loaded by load_trace().
+//
+// Returns NULL if unknown, or a TRACE_PROCESS_TYPE owned by the trace.
+GVariant * replay_process(const gchar *name)
+{
+    return replay_processes ? g_hash_table_lookup(replay_processes, name) : NULL;
+}
+
+// Find the reply to request in the trace loaded by load_trace().
+//
+// Returns NULL on error, or a reply you should free with g_object_unref().
+GDBusMessage * replay_message(GDBusMessage *request, GError **error)
+{
+    GDBusMessage *reply;
+    GVariant *record;
+    GQueue *queue;
+    gchar *key;
+    gsize index;
+
+    key = get_request_key(request);
+
+    g_mutex_lock(&trace_lock);
+
+    if (requests == NULL || !(queue = g_hash_table_lookup(requests, key))) {
+        g_mutex_unlock(&trace_lock);
+        g_debug("request not found in trace: %s", key);
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "request not found in trace");
+        g_free(key);
+        return NULL;
+    }
+
+    // The last reply is reused for any further identical requests.
+    if (g_queue_get_length(queue) > 1) {
+        index = GPOINTER_TO_SIZE(g_queue_pop_head(queue));
+    } else {
+        index = GPOINTER_TO_SIZE(g_queue_peek_head(queue));
+    }
+
+    g_mutex_unlock(&trace_lock);
+
+    record = g_variant_get_child_value(replay_records, index);
+    reply  = build_replay_message(request, record, error);
+
+    g_variant_unref(record);
+    g_free(key);
+    return reply;
+}
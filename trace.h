@@ -0,0 +1,18 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+// Process details of a name owner, as pid, uid, user and cmdline.
+#define TRACE_PROCESS_TYPE "(iusas)"
+
+void record_message(GDBusMessage *request, GDBusMessage *reply, const GError *error);
+GDBusMessage * replay_message(GDBusMessage *request, GError **error);
+void record_process(const gchar *name, GVariant *details);
+GVariant * replay_process(const gchar *name);
+gboolean load_trace(const gchar *filename);
+gboolean save_trace(const gchar *filename);
+
+// Options
+extern gchar *trace_record_file;
+extern gchar *trace_replay_file;
+
+#endif
@@ -8,62 +8,249 @@
 
 
 #include "util.h"
+#include "scan.h"
+#include "latency.h"
+#include "activation.h"
+#include "wire.h"
+#include "stats.h"
+#include "trace.h"
 
-static gchar* dump_property(xmlNodePtr node, const char* prop)
+// A D-Bus signature is at most 255 characters, so this is the most arguments
+// a message can have.
+#define MAX_INVALID_ARGS 255
+
+// The type of an argument that won't match the complete type at sig. Strings
+// are often converted between each other, so they get a double.
+static gchar get_invalid_type(const gchar *sig)
 {
-    xmlChar* value = xmlGetProp(node, (const xmlChar*)prop);
-    char* ret = g_strdup((gchar*)value);
-    if (value != NULL)
-        xmlFree(value);
-    return ret;
+    return *sig == 's' || *sig == 'o' || *sig == 'g' ? 'd' : 's';
 }
 
-
+// Build a body that the method will reject before doing any work, where sig is
+// the complete signature of its in-args.
+//
+// Every argument has the wrong type, and there is one more argument than the
+// method takes, so that bindings which only check arity, or only unpack the
+// arguments they expect, still reject it.
 GVariant* build_invalid_body(const gchar* sig)
 {
-    if (sig == NULL || g_str_equal(sig, "s")) {
-        return g_variant_new("(d)", 0);
-    } else {
-        return g_variant_new("(s)", "INVALID STRING");
+    GVariant *args[MAX_INVALID_ARGS];
+    gchar type[MAX_INVALID_ARGS + 3] = "(";
+    const gchar *next = sig;
+    const gchar *end;
+    guint count = 0;
+
+    while (next && *next && count < MAX_INVALID_ARGS - 1) {
+        type[++count] = get_invalid_type(next);
+
+        // Skip to the next complete type, malformed signatures are one argument.
+        if (!g_variant_type_string_scan(next, NULL, &end)) {
+            break;
+        }
+
+        next = end;
     }
-}
 
-gchar* get_method_signature(xmlNodePtr node) {
-    if (node == NULL) {
-        return NULL;
+    type[++count] = 'd';
+    type[count + 1] = ')';
+    type[count + 2] = '\0';
+
+    // For properties, sig is a single type and the body is sent as its value,
+    // so it mustn't be a struct of the right type by chance.
+    if (g_strcmp0(type, sig) == 0) {
+        type[count] = 's';
     }
-    xmlNodePtr cur = node->children;
-    while (cur != NULL) {
-        const gchar* name = (const gchar*)cur->name;
-        if (name == NULL) {
-            cur = cur->next;
-            continue;
-        }
-        if (g_str_equal("arg", name)) {
-            xmlChar* s = xmlGetProp(cur, (const xmlChar*)"direction");
-            if (s) {
-                if (!g_str_equal(s, "out")) {
-                    xmlFree(s);
-                    return dump_property(cur, "type");
-                 }
-                xmlFree(s);
-            } else {
-                g_message("unknown argument direction");
-            }
+
+    for (guint i = 0; i < count; i++) {
+        if (type[i + 1] == 'd') {
+            args[i] = g_variant_new_double(0);
+        } else {
+            args[i] = g_variant_new_string("INVALID STRING");
         }
-        cur = cur->next;
     }
-    return NULL;
+
+    return g_variant_new_tuple(args, count);
+}
+
+#define BUS_LABEL_KEY "dbus-map-bus-label"
+
+// Tag a connection with the label of the bus it's connected to, see scan_t.
+void set_bus_label(GDBusConnection *bus, const gchar *label)
+{
+    g_object_set_data_full(G_OBJECT(bus), BUS_LABEL_KEY, g_strdup(label), g_free);
+}
+
+// Latency and stats are kept per service, and the same name can be on several
+// buses, so they're keyed by label:name if bus has a label.
+//
+// Returns dest if there's no label, otherwise an interned string.
+const gchar * get_service_key(GDBusConnection *bus, const gchar *dest)
+{
+    const gchar *label = bus ? g_object_get_data(G_OBJECT(bus), BUS_LABEL_KEY) : NULL;
+    const gchar *result;
+    gchar *key;
+
+    if (label == NULL || dest == NULL) {
+        return dest;
+    }
+
+    key     = g_strdup_printf("%s:%s", label, dest);
+    result  = g_intern_string(key);
+
+    g_free(key);
+    return result;
 }
 
-gchar* get_property_signature(xmlNodePtr node) {
-    if (node == NULL) {
+// All scan traffic goes through g_dbus_scan_send(), which picks a timeout for
+// the destination and records how long it took to reply. If a native
+// transport is attached to the connection, it is used instead of GDBus. With
+// --replay, replies come from the trace and bus is not used.
+//
+// Returns NULL on error, or a reply you should free with g_object_unref().
+GDBusMessage * g_dbus_scan_send(GDBusConnection *bus, GDBusMessage *msg, GError **error)
+{
+    const gchar *dest = g_dbus_message_get_destination(msg);
+    const gchar *service = get_service_key(bus, dest);
+    latency_class_t class = get_latency_class(msg);
+    wire_transport_t *wire;
+    GDBusMessage *reply;
+    GError *local = NULL;
+    gboolean timedout;
+    gint64 start;
+
+    if (is_service_degraded(service, class)) {
+        record_service_skipped(service);
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_CANCELLED, "%s is not responding, skipped", dest);
         return NULL;
     }
-    return dump_property(node, "type");
+
+    apply_activation_policy(msg);
+
+    start = g_get_monotonic_time();
+    if (trace_replay_file) {
+        reply = replay_message(msg, &local);
+    } else if ((wire = get_wire_transport(bus))) {
+        reply = wire_send_message(wire, msg, get_service_timeout(service, class), &local);
+    } else {
+        reply = g_dbus_send(bus, msg, G_DBUS_SEND_MESSAGE_FLAGS_NONE, get_service_timeout(service, class), NULL, NULL, &local);
+    }
+
+    record_message(msg, reply, local);
+
+    timedout = g_error_matches(local, G_IO_ERROR, G_IO_ERROR_TIMED_OUT);
+
+    record_service_latency(service, class, g_get_monotonic_time() - start, timedout);
+    record_stats(get_call_phase(msg), service, start, timedout);
+
+    if (local)
+        g_propagate_error(error, local);
+
+    return reply;
 }
 
+typedef struct {
+    gchar          *dest;
+    const gchar    *service;    // See get_service_key().
+    gint64          start;
+    stats_phase_t   phase;
+    latency_class_t class;
+    GDBusMessage   *request;    // Only kept for --record.
+} scan_send_t;
 
+static void scan_send_free(gpointer data)
+{
+    scan_send_t *send = data;
+    if (send->request)
+        g_object_unref(send->request);
+    g_free(send->dest);
+    g_free(send);
+}
+
+static void scan_send_complete(GTask *task, GDBusMessage *reply, GError *error)
+{
+    scan_send_t *send = g_task_get_task_data(task);
+    gboolean timedout;
+
+    record_message(send->request, reply, error);
+
+    timedout = g_error_matches(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT);
+
+    record_service_latency(send->service, send->class, g_get_monotonic_time() - send->start, timedout);
+    record_stats(send->phase, send->service, send->start, timedout);
+
+    if (reply) {
+        g_task_return_pointer(task, reply, g_object_unref);
+    } else {
+        g_task_return_error(task, error);
+    }
+
+    g_object_unref(task);
+}
+
+static void scan_send_ready(GObject *source, GAsyncResult *res, gpointer data)
+{
+    GDBusMessage *reply;
+    GError *error = NULL;
+
+    reply = g_dbus_connection_send_message_with_reply_finish(G_DBUS_CONNECTION(source), res, &error);
+
+    scan_send_complete(data, reply, error);
+}
+
+// Asynchronous version of g_dbus_scan_send(), the callback is invoked in the
+// thread-default main context. Use g_dbus_scan_send_finish() to get the reply.
+void g_dbus_scan_send_async(GDBusConnection *bus, GDBusMessage *msg, GAsyncReadyCallback callback, gpointer user)
+{
+    scan_send_t *send;
+    GTask *task;
+
+    task            = g_task_new(bus, NULL, callback, user);
+    send            = g_new0(scan_send_t, 1);
+    send->dest      = g_strdup(g_dbus_message_get_destination(msg));
+    send->service   = get_service_key(bus, send->dest);
+    send->start     = g_get_monotonic_time();
+    send->phase     = get_call_phase(msg);
+    send->class     = get_latency_class(msg);
+
+    g_task_set_task_data(task, send, scan_send_free);
+
+    if (is_service_degraded(send->service, send->class)) {
+        record_service_skipped(send->service);
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_CANCELLED, "%s is not responding, skipped", send->dest);
+        g_object_unref(task);
+        return;
+    }
+
+    apply_activation_policy(msg);
+
+    if (trace_record_file) {
+        send->request = g_object_ref(msg);
+    }
+
+    if (trace_replay_file) {
+        GDBusMessage *reply;
+        GError *error = NULL;
+
+        reply = replay_message(msg, &error);
+        scan_send_complete(task, reply, error);
+        return;
+    }
+
+    g_dbus_connection_send_message_with_reply(bus,
+                                              msg,
+                                              G_DBUS_SEND_MESSAGE_FLAGS_NONE,
+                                              get_service_timeout(send->service, send->class),
+                                              NULL,
+                                              NULL,
+                                              scan_send_ready,
+                                              task);
+}
+
+// Returns NULL on error, or a reply you should free with g_object_unref().
+GDBusMessage * g_dbus_scan_send_finish(G_GNUC_UNUSED GDBusConnection *bus, GAsyncResult *res, GError **error)
+{
+    return g_task_propagate_pointer(G_TASK(res), error);
+}
 
 // Simple wrapper for a common D-Bus pattern.
 GVariant * g_dbus_simple_send(GDBusConnection *bus, GDBusMessage *msg, const gchar *type)
@@ -72,7 +259,7 @@ GVariant * g_dbus_simple_send(GDBusConnection *bus, GDBusMessage *msg, const gch
     GVariant *body;
     gchar *fmt;
 
-    if (!(reply = g_dbus_send(bus, msg, 0, timeout, 0, 0, 0))) {
+    if (!(reply = g_dbus_scan_send(bus, msg, NULL))) {
         g_object_unref(msg);
         return NULL;
     }
@@ -99,3 +286,48 @@ GVariant * g_dbus_simple_send(GDBusConnection *bus, GDBusMessage *msg, const gch
     return body;
 }
 
+scan_t * new_scan(GDBusConnection *bus, const gchar *name)
+{
+    scan_t *scan    = g_new0(scan_t, 1);
+
+    scan->bus       = bus;
+    scan->name      = g_strdup(name);
+    scan->members   = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    return scan;
+}
+
+void free_scan(scan_t *scan)
+{
+    if (scan->output)
+        g_string_free(scan->output, true);
+    if (scan->verdicts)
+        g_hash_table_destroy(scan->verdicts);
+    if (scan->managers)
+        g_ptr_array_unref(scan->managers);
+    if (scan->managed)
+        g_hash_table_destroy(scan->managed);
+
+    g_hash_table_destroy(scan->members);
+    g_free(scan->fingerprint);
+    g_free(scan->name);
+    g_free(scan);
+}
+
+// Print scan output, or buffer it if the scan is running on a worker thread.
+void scan_printf(scan_t *scan, const gchar *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+
+    if (scan && scan->output) {
+        g_string_append_vprintf(scan->output, format, ap);
+    } else {
+        gchar *str = g_strdup_vprintf(format, ap);
+        g_print("%s", str);
+        g_free(str);
+    }
+
+    va_end(ap);
+}
@@ -6,12 +6,14 @@
 
 extern gint timeout;
 
-#include <libxml/xpath.h>
-gchar* get_method_signature(xmlNodePtr node);
-gchar* get_property_signature(xmlNodePtr node);
-
 GVariant* build_invalid_body(const gchar* sig);
 
+void set_bus_label(GDBusConnection *bus, const gchar *label);
+const gchar * get_service_key(GDBusConnection *bus, const gchar *dest);
+
 GVariant * g_dbus_simple_send(GDBusConnection *bus, GDBusMessage *msg, const gchar *type);
+GDBusMessage * g_dbus_scan_send(GDBusConnection *bus, GDBusMessage *msg, GError **error);
+void g_dbus_scan_send_async(GDBusConnection *bus, GDBusMessage *msg, GAsyncReadyCallback callback, gpointer user);
+GDBusMessage * g_dbus_scan_send_finish(GDBusConnection *bus, GAsyncResult *res, GError **error);
 
 #endif
@@ -0,0 +1,259 @@
+#define _GNU_SOURCE
+#include <gio/gio.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "cache.h"
+#include "probes.h"
+#include "verdicts.h"
+
+// Probing a method or property sends a real call, which can trigger polkit
+// prompts and audit logs. If the service hasn't changed and we're the same
+// user in the same kind of session, answering polkit prompts the same way, the
+// answer will be the same as last time, so verdicts are remembered in the
+// cache directory.
+//
+// The file is a serialized GVariant of type a{s(yx)}, mapping a key to the
+// verdict and the time it was last used. Only conclusive verdicts are kept,
+// a service that didn't reply might answer next time. Entries that haven't
+// been used for a while are dropped, so that old fingerprints don't
+// accumulate forever.
+
+#define VERDICT_FILE_TYPE "a{s(yx)}"
+
+// Forget verdicts not used for this long, in microseconds.
+#define VERDICT_EXPIRY_TIME ((gint64) 30 * 24 * 60 * 60 * G_USEC_PER_SEC)
+
+typedef struct {
+    guint8      verdict;
+    gint64      used;
+} cached_verdict_t;
+
+static GHashTable *verdicts;
+static GMutex verdicts_lock;
+static gchar *caller;
+static gboolean dirty;
+
+// Polkit usually treats active and inactive sessions differently, so that is
+// part of our identity. Ask logind which session we're in and whether it's
+// active.
+//
+// Returns a string you should free with g_free().
+gchar * get_caller_identity(void)
+{
+    GDBusConnection *system;
+    GDBusMessage *request;
+    GVariant *session;
+    GVariant *active;
+    GVariant *value;
+    gboolean state;
+    gchar *path;
+    gchar *result;
+
+    if (!(system = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, NULL))) {
+        return g_strdup_printf("%u:none", getuid());
+    }
+
+    request = g_dbus_method("org.freedesktop.login1",
+                            "/org/freedesktop/login1",
+                            "org.freedesktop.login1.Manager",
+                            "GetSessionByPID");
+
+    g_dbus_message_set_body(request, g_variant_new("(u)", getpid()));
+
+    if (!(session = g_dbus_simple_send(system, request, "(o)"))) {
+        g_object_unref(system);
+        return g_strdup_printf("%u:none", getuid());
+    }
+
+    g_variant_get(session, "(o)", &path);
+
+    request = g_dbus_method("org.freedesktop.login1",
+                            path,
+                            "org.freedesktop.DBus.Properties",
+                            "Get");
+
+    g_dbus_message_set_body(request, g_variant_new("(ss)", "org.freedesktop.login1.Session", "Active"));
+
+    if ((active = g_dbus_simple_send(system, request, "(v)"))) {
+        g_variant_get(active, "(v)", &value);
+        state   = g_variant_is_of_type(value, G_VARIANT_TYPE("b")) && g_variant_get_boolean(value);
+        result  = g_strdup_printf("%u:%s", getuid(), state ? "active" : "inactive");
+        g_variant_unref(value);
+        g_variant_unref(active);
+    } else {
+        result  = g_strdup_printf("%u:none", getuid());
+    }
+
+    g_variant_unref(session);
+    g_object_unref(system);
+    g_free(path);
+    return result;
+}
+
+static gchar * get_verdict_filename(void)
+{
+    return g_build_filename(introspect_cache_dir, "verdicts", NULL);
+}
+
+// Load previous verdicts, does nothing unless --cache is enabled. Agent says
+// how polkit prompts are being answered, e.g. none or dismiss, as that changes
+// which members can be reached.
+void load_verdict_cache(const gchar *agent)
+{
+    GMappedFile *file;
+    GVariantIter iter;
+    GVariant *stored;
+    GBytes *bytes;
+    gchar *filename;
+    gchar *identity;
+    gchar *key;
+    cached_verdict_t value;
+
+    if (introspect_cache_dir == NULL) {
+        return;
+    }
+
+    identity    = get_caller_identity();
+    caller      = g_strdup_printf("%s:%s", identity, agent);
+    verdicts    = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    filename    = get_verdict_filename();
+
+    g_debug("verdicts are cached for caller %s", caller);
+
+    g_free(identity);
+
+    if (!(file = g_mapped_file_new(filename, false, NULL))) {
+        g_free(filename);
+        return;
+    }
+
+    bytes   = g_mapped_file_get_bytes(file);
+    stored  = g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE(VERDICT_FILE_TYPE), bytes, false));
+
+    g_variant_iter_init(&iter, stored);
+
+    while (g_variant_iter_next(&iter, "{s(yx)}", &key, &value.verdict, &value.used)) {
+        if (value.verdict >= VERDICT_MAX) {
+            g_free(key);
+            continue;
+        }
+        g_hash_table_insert(verdicts, key, g_memdup2(&value, sizeof value));
+    }
+
+    g_debug("loaded %u cached verdicts", g_hash_table_size(verdicts));
+
+    g_variant_unref(stored);
+    g_bytes_unref(bytes);
+    g_mapped_file_unref(file);
+    g_free(filename);
+}
+
+// Label is the bus the service is on (see scan_t), so that the same name on
+// several buses doesn't share verdicts.
+static gchar * get_verdict_key(const gchar *label, const gchar *fingerprint, gchar kind, const gchar *interface, const gchar *member, const gchar *sig)
+{
+    if (label) {
+        return g_strdup_printf("%s %s %c %s %s %s %s", label, fingerprint, kind, interface, member, sig ? sig : "", caller);
+    }
+
+    return g_strdup_printf("%s %c %s %s %s %s", fingerprint, kind, interface, member, sig ? sig : "", caller);
+}
+
+// Find a previous verdict for this member of a service on the bus with label,
+// with the specified fingerprint. Kind is 'm' for methods, or 'p' for
+// properties.
+//
+// Returns true and sets verdict if known.
+gboolean lookup_verdict(const gchar *label, const gchar *fingerprint, gchar kind, const gchar *interface, const gchar *member, const gchar *sig, verdict_t *verdict)
+{
+    cached_verdict_t *value;
+    gchar *key;
+
+    if (verdicts == NULL || fingerprint == NULL) {
+        return false;
+    }
+
+    key = get_verdict_key(label, fingerprint, kind, interface, member, sig);
+
+    g_mutex_lock(&verdicts_lock);
+
+    if ((value = g_hash_table_lookup(verdicts, key))) {
+        *verdict    = value->verdict;
+        value->used = g_get_real_time();
+        dirty       = true;
+    }
+
+    g_mutex_unlock(&verdicts_lock);
+    g_free(key);
+    return value != NULL;
+}
+
+void store_verdict(const gchar *label, const gchar *fingerprint, gchar kind, const gchar *interface, const gchar *member, const gchar *sig, verdict_t verdict)
+{
+    cached_verdict_t *value;
+
+    if (verdicts == NULL || fingerprint == NULL) {
+        return;
+    }
+
+    // A timeout, a skipped degraded service or an unrecognised error might
+    // have a different answer next time.
+    if (verdict != VERDICT_ALLOWED && verdict != VERDICT_DENIED) {
+        return;
+    }
+
+    value           = g_new0(cached_verdict_t, 1);
+    value->verdict  = verdict;
+    value->used     = g_get_real_time();
+
+    g_mutex_lock(&verdicts_lock);
+    g_hash_table_replace(verdicts, get_verdict_key(label, fingerprint, kind, interface, member, sig), value);
+    dirty = true;
+    g_mutex_unlock(&verdicts_lock);
+}
+
+void save_verdict_cache(void)
+{
+    GVariantBuilder builder;
+    GHashTableIter iter;
+    GVariant *contents;
+    GError *error = NULL;
+    gchar *filename;
+    gpointer key;
+    gpointer data;
+    gint64 expiry;
+
+    if (verdicts == NULL || !dirty) {
+        return;
+    }
+
+    expiry = g_get_real_time() - VERDICT_EXPIRY_TIME;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE(VERDICT_FILE_TYPE));
+    g_hash_table_iter_init(&iter, verdicts);
+
+    while (g_hash_table_iter_next(&iter, &key, &data)) {
+        cached_verdict_t *value = data;
+
+        if (value->used > expiry) {
+            g_variant_builder_add(&builder, "{s(yx)}", key, value->verdict, value->used);
+        }
+    }
+
+    contents = g_variant_ref_sink(g_variant_builder_end(&builder));
+    filename = get_verdict_filename();
+
+    if (g_mkdir_with_parents(introspect_cache_dir, 0700) != 0
+     || !g_file_set_contents(filename, g_variant_get_data(contents), g_variant_get_size(contents), &error)) {
+        g_warning("failed to write verdict cache %s, %s", filename, error ? error->message : "mkdir failed");
+        g_clear_error(&error);
+    }
+
+    g_variant_unref(contents);
+    g_free(filename);
+}
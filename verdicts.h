@@ -0,0 +1,10 @@
+#ifndef __VERDICTS_H
+#define __VERDICTS_H
+
+gchar * get_caller_identity(void);
+void load_verdict_cache(const gchar *agent);
+gboolean lookup_verdict(const gchar *label, const gchar *fingerprint, gchar kind, const gchar *interface, const gchar *member, const gchar *sig, verdict_t *verdict);
+void store_verdict(const gchar *label, const gchar *fingerprint, gchar kind, const gchar *interface, const gchar *member, const gchar *sig, verdict_t verdict);
+void save_verdict_cache(void);
+
+#endif
@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+#include <gio/gio.h>
+#include <glib-unix.h>
+#include <proc/readproc.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "scan.h"
+#include "parser.h"
+#include "probes.h"
+#include "snapshot.h"
+#include "output.h"
+#include "watch.h"
+#include "symbols.h"
+
+// --watch keeps dbus-map running after the initial scan, and only rescans
+// what changed.
+//
+// When a name gets a new owner, the name is rescanned from scratch and only
+// members with a different verdict are reported, followed by any members that
+// no longer exist. When a service that implements ObjectManager announces new
+// objects, only the objects below that path are walked, and only members not
+// already seen on that name are reported.
+//
+// Services often acquire their name before they've finished exporting
+// objects, so rescans are delayed until the name has been quiet for a moment.
+//
+// Signals are subscribed to before the names are listed, and queue up on the
+// watcher context during the initial scan, so that names that change owner
+// while they're being scanned are rescanned rather than missed.
+
+// Milliseconds to wait after a name changes owner before rescanning it.
+#define WATCH_SETTLE_TIME 500
+
+struct _watcher {
+    GDBusConnection *bus;
+    const gchar     *label;     // See scan_t, the same for every name.
+    watch_rescan_t   rescan;
+    GHashTable      *scans;     // name -> scan_t of the latest scan.
+    GHashTable      *owners;    // name -> unique name of the current owner.
+    GHashTable      *pending;   // names waiting to be rescanned.
+    GMainContext    *context;
+    GSource         *timer;
+    guint            subscriptions[3];
+};
+
+static gchar * get_name_owner(GDBusConnection *bus, const gchar *name)
+{
+    GDBusMessage *request;
+    GDBusMessage *reply;
+    gchar *owner = NULL;
+
+    request = g_dbus_method("org.freedesktop.DBus",
+                            "/org/freedesktop/DBus",
+                            "org.freedesktop.DBus",
+                            "GetNameOwner");
+
+    g_dbus_message_set_body(request, g_variant_new("(s)", name));
+
+    if ((reply = g_dbus_scan_send(bus, request, NULL))) {
+        if (g_dbus_message_get_message_type(reply) == G_DBUS_MESSAGE_TYPE_METHOD_RETURN) {
+            g_variant_get(g_dbus_message_get_body(reply), "(s)", &owner);
+        }
+        g_object_unref(reply);
+    }
+
+    g_object_unref(request);
+    return owner;
+}
+
+static void rescan_name(watcher_t *watcher, const gchar *name)
+{
+    GHashTableIter iter;
+    scan_t *previous;
+    scan_t *scan;
+    gpointer key;
+
+    previous        = g_hash_table_lookup(watcher->scans, name);
+    scan            = new_scan(watcher->bus, name);
+    scan->label     = watcher->label;
+    scan->verdicts  = g_hash_table_new(g_direct_hash, g_direct_equal);
+    scan->previous  = previous ? previous->verdicts : NULL;
+
+    watcher->rescan(scan, NULL);
+
+    if (previous) {
+        g_hash_table_iter_init(&iter, previous->verdicts);
+
+        while (g_hash_table_iter_next(&iter, &key, NULL)) {
+            if (!g_hash_table_contains(scan->verdicts, key)) {
+                report_member_removed(scan, symbol_to_str(GPOINTER_TO_UINT(key)));
+            }
+        }
+    }
+
+    scan->previous = NULL;
+
+    // This releases the previous scan.
+    g_hash_table_insert(watcher->scans, g_strdup(name), scan);
+}
+
+static gboolean rescan_pending_names(gpointer user)
+{
+    watcher_t *watcher = user;
+    GHashTableIter iter;
+    gpointer name;
+
+    watcher->timer = NULL;
+
+    g_hash_table_iter_init(&iter, watcher->pending);
+
+    while (g_hash_table_iter_next(&iter, &name, NULL)) {
+        rescan_name(watcher, name);
+        g_hash_table_iter_remove(&iter);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static void name_owner_changed(G_GNUC_UNUSED GDBusConnection *bus,
+                               G_GNUC_UNUSED const gchar *sender,
+                               G_GNUC_UNUSED const gchar *path,
+                               G_GNUC_UNUSED const gchar *interface,
+                               G_GNUC_UNUSED const gchar *signal,
+                               GVariant *parameters,
+                               gpointer user)
+{
+    watcher_t *watcher = user;
+    const gchar *name;
+    const gchar *oldowner;
+    const gchar *newowner;
+
+    g_variant_get(parameters, "(&s&s&s)", &name, &oldowner, &newowner);
+
+    g_debug("%s changed owner from %s to %s", name, oldowner, newowner);
+
+    if (*newowner == '\0') {
+        g_hash_table_remove(watcher->owners, name);
+        g_hash_table_remove(watcher->pending, name);
+
+        if (g_hash_table_contains(watcher->scans, name)) {
+            report_service_removed(name);
+            g_hash_table_remove(watcher->scans, name);
+        }
+        return;
+    }
+
+    g_hash_table_insert(watcher->owners, g_strdup(name), g_strdup(newowner));
+    g_hash_table_add(watcher->pending, g_strdup(name));
+
+    if (watcher->timer) {
+        g_source_destroy(watcher->timer);
+    }
+
+    watcher->timer = g_timeout_source_new(WATCH_SETTLE_TIME);
+
+    g_source_set_callback(watcher->timer, rescan_pending_names, watcher, NULL);
+    g_source_attach(watcher->timer, watcher->context);
+    g_source_unref(watcher->timer);
+}
+
+// Objects can be added or removed without the owner changing, so find every
+// name owned by the sender and handle the change on each of them.
+static void object_interfaces_changed(G_GNUC_UNUSED GDBusConnection *bus,
+                                      const gchar *sender,
+                                      G_GNUC_UNUSED const gchar *path,
+                                      G_GNUC_UNUSED const gchar *interface,
+                                      const gchar *signal,
+                                      GVariant *parameters,
+                                      gpointer user)
+{
+    watcher_t *watcher = user;
+    GHashTableIter iter;
+    GVariantIter *added;
+    const gchar **interfaces;
+    const gchar *object;
+    gboolean removed;
+    gpointer name;
+    gpointer owner;
+    gchar *value;
+
+    if ((removed = g_strcmp0(signal, "InterfacesRemoved") == 0)) {
+        g_variant_get(parameters, "(&o^a&s)", &object, &interfaces);
+    } else {
+        GPtrArray *names = g_ptr_array_new();
+
+        g_variant_get(parameters, "(&oa{sa{sv}})", &object, &added);
+
+        while (g_variant_iter_loop(added, "{&s@a{sv}}", &value, NULL)) {
+            g_ptr_array_add(names, value);
+        }
+
+        g_ptr_array_add(names, NULL);
+        interfaces = (const gchar **) g_ptr_array_free(names, false);
+    }
+
+    g_hash_table_iter_init(&iter, watcher->owners);
+
+    while (g_hash_table_iter_next(&iter, &name, &owner)) {
+        scan_t *scan = g_hash_table_lookup(watcher->scans, name);
+
+        // A full rescan is already queued.
+        if (scan == NULL || g_strcmp0(owner, sender) != 0 || g_hash_table_contains(watcher->pending, name)) {
+            continue;
+        }
+
+        report_object_change(scan, removed ? '-' : '+', object, interfaces);
+
+        // Members of removed objects may still be implemented elsewhere, and
+        // will be noticed the next time the name is rescanned.
+        if (!removed) {
+            watcher->rescan(scan, object);
+        }
+    }
+
+    if (!removed) {
+        g_variant_iter_free(added);
+    }
+
+    g_free(interfaces);
+}
+
+static gboolean stop_watching(gpointer user)
+{
+    g_main_loop_quit(user);
+    return G_SOURCE_REMOVE;
+}
+
+static void add_stop_signal(GMainContext *context, gint signum, GMainLoop *loop)
+{
+    GSource *source = g_unix_signal_source_new(signum);
+
+    g_source_set_callback(source, stop_watching, loop, NULL);
+    g_source_attach(source, context);
+    g_source_unref(source);
+}
+
+// Subscribe to the signals that watch mode reports on. This should be called
+// before the names to scan are listed, changes are queued until
+// watch_services() is called.
+//
+// Signals and timers are dispatched on a private context, the default context
+// belongs to the polkit agent thread with --null-agent. A rescan running there
+// could wait forever for a prompt that only that thread can dismiss.
+watcher_t * start_watching(GDBusConnection *bus, const gchar *filter, watch_rescan_t rescan)
+{
+    watcher_t *watcher;
+
+    watcher             = g_new0(watcher_t, 1);
+    watcher->bus        = bus;
+    watcher->rescan     = rescan;
+    watcher->scans      = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) free_scan);
+    watcher->owners     = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    watcher->pending    = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    watcher->context    = g_main_context_new();
+
+    // Signal subscriptions are dispatched to the thread-default context at
+    // the time they're made.
+    g_main_context_push_thread_default(watcher->context);
+
+    watcher->subscriptions[0] = g_dbus_connection_signal_subscribe(bus,
+                                                                   "org.freedesktop.DBus",
+                                                                   "org.freedesktop.DBus",
+                                                                   "NameOwnerChanged",
+                                                                   "/org/freedesktop/DBus",
+                                                                   filter,
+                                                                   G_DBUS_SIGNAL_FLAGS_NONE,
+                                                                   name_owner_changed,
+                                                                   watcher,
+                                                                   NULL);
+    watcher->subscriptions[1] = g_dbus_connection_signal_subscribe(bus,
+                                                                   NULL,
+                                                                   "org.freedesktop.DBus.ObjectManager",
+                                                                   "InterfacesAdded",
+                                                                   NULL,
+                                                                   NULL,
+                                                                   G_DBUS_SIGNAL_FLAGS_NONE,
+                                                                   object_interfaces_changed,
+                                                                   watcher,
+                                                                   NULL);
+    watcher->subscriptions[2] = g_dbus_connection_signal_subscribe(bus,
+                                                                   NULL,
+                                                                   "org.freedesktop.DBus.ObjectManager",
+                                                                   "InterfacesRemoved",
+                                                                   NULL,
+                                                                   NULL,
+                                                                   G_DBUS_SIGNAL_FLAGS_NONE,
+                                                                   object_interfaces_changed,
+                                                                   watcher,
+                                                                   NULL);
+
+    g_main_context_pop_thread_default(watcher->context);
+    return watcher;
+}
+
+// Take ownership of the completed scans, and report changes until interrupted,
+// starting with any queued during the scan. The scans array is left empty, and
+// the watcher is freed.
+void watch_services(watcher_t *watcher, GPtrArray *scans)
+{
+    GMainLoop *loop;
+
+    watcher->label = scans->len ? ((scan_t *) g_ptr_array_index(scans, 0))->label : NULL;
+
+    for (guint i = 0; i < scans->len; i++) {
+        scan_t *scan = g_ptr_array_index(scans, i);
+        gchar *owner = *scan->name == ':' ? g_strdup(scan->name) : get_name_owner(watcher->bus, scan->name);
+
+        // Output has already been printed, and worker connections are gone.
+        if (scan->output) {
+            g_string_free(scan->output, true);
+            scan->output = NULL;
+        }
+
+        scan->bus = watcher->bus;
+
+        if (owner) {
+            g_hash_table_insert(watcher->owners, g_strdup(scan->name), owner);
+        }
+
+        g_hash_table_insert(watcher->scans, g_strdup(scan->name), scan);
+    }
+
+    g_ptr_array_set_size(scans, 0);
+
+    g_main_context_push_thread_default(watcher->context);
+
+    loop = g_main_loop_new(watcher->context, false);
+
+    add_stop_signal(watcher->context, SIGINT, loop);
+    add_stop_signal(watcher->context, SIGTERM, loop);
+
+    g_debug("watching %u names for changes", g_hash_table_size(watcher->scans));
+
+    g_main_loop_run(loop);
+
+    for (guint i = 0; i < G_N_ELEMENTS(watcher->subscriptions); i++) {
+        g_dbus_connection_signal_unsubscribe(watcher->bus, watcher->subscriptions[i]);
+    }
+
+    if (watcher->timer) {
+        g_source_destroy(watcher->timer);
+    }
+
+    g_main_context_pop_thread_default(watcher->context);
+    g_main_loop_unref(loop);
+    g_main_context_unref(watcher->context);
+    g_hash_table_destroy(watcher->pending);
+    g_hash_table_destroy(watcher->owners);
+    g_hash_table_destroy(watcher->scans);
+    g_free(watcher);
+}
@@ -0,0 +1,12 @@
+#ifndef __WATCH_H
+#define __WATCH_H
+
+typedef struct _watcher watcher_t;
+
+// Rescan a name from scratch if root is NULL, otherwise just the objects below root.
+typedef void (*watch_rescan_t)(scan_t *scan, const gchar *root);
+
+watcher_t * start_watching(GDBusConnection *bus, const gchar *filter, watch_rescan_t rescan);
+void watch_services(watcher_t *watcher, GPtrArray *scans);
+
+#endif
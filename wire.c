@@ -0,0 +1,668 @@
+#define _GNU_SOURCE
+#include <gio/gio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wire.h"
+
+// A minimal D-Bus client for synchronous scan traffic.
+//
+// GDBus sends every message through a worker thread and delivers replies via
+// a main context, which is most of the CPU time of a large scan. This speaks
+// the wire protocol directly on a second connection to the bus: SASL EXTERNAL
+// authentication, Hello, then one blocking request and reply at a time.
+//
+// Requests are marshalled into a buffer that is reused for every message.
+// Replies are received straight into the spare capacity of another reusable
+// buffer, then g_dbus_message_new_from_blob() builds a GDBusMessage from it,
+// so results are the same as with GDBus. That still copies the body into a
+// GVariant, and moves any bytes after the message to the front of the buffer.
+//
+// Method calls from other peers are answered with an error, as GDBus does for
+// objects that aren't exported.
+//
+// The transport is attached to a GDBusConnection as object data, and used by
+// g_dbus_scan_send() if present. Asynchronous sends still use GDBus.
+
+// Options
+gboolean enable_wire_transport;
+
+#define WIRE_DATA_KEY "dbus-map-wire-transport"
+
+// The protocol limits messages to 128MiB.
+#define WIRE_MAX_MESSAGE_SIZE (128 * 1024 * 1024)
+
+// GDBus uses this if the timeout is -1.
+#define WIRE_DEFAULT_TIMEOUT (25 * 1000)
+
+// Size of the fixed part of the header, enough to find the message length.
+#define WIRE_FIXED_HEADER_SIZE 16
+
+// Minimum space to make available in wire->input for each recv().
+#define WIRE_READ_SIZE 16384
+
+enum {
+    WIRE_FIELD_PATH         = 1,
+    WIRE_FIELD_INTERFACE    = 2,
+    WIRE_FIELD_MEMBER       = 3,
+    WIRE_FIELD_DESTINATION  = 6,
+    WIRE_FIELD_SIGNATURE    = 8,
+};
+
+struct _wire_transport {
+    gint         fd;
+    guint32      serial;
+    GByteArray  *output;    // Reused for every request.
+    GByteArray  *input;     // Bytes received but not yet parsed.
+    GMutex       lock;
+};
+
+static void wire_transport_free(gpointer data)
+{
+    wire_transport_t *wire = data;
+
+    close(wire->fd);
+    g_byte_array_unref(wire->output);
+    g_byte_array_unref(wire->input);
+    g_mutex_clear(&wire->lock);
+    g_free(wire);
+}
+
+static void wire_pad(GByteArray *buffer, gsize alignment)
+{
+    static const guint8 zero[8];
+
+    if (buffer->len % alignment) {
+        g_byte_array_append(buffer, zero, alignment - buffer->len % alignment);
+    }
+}
+
+static void wire_append(GByteArray *buffer, gsize alignment, gconstpointer data, gsize size)
+{
+    wire_pad(buffer, alignment);
+    g_byte_array_append(buffer, data, size);
+}
+
+static void wire_append_u32(GByteArray *buffer, guint32 value)
+{
+    wire_append(buffer, 4, &value, sizeof value);
+}
+
+static void wire_append_string(GByteArray *buffer, const gchar *str)
+{
+    wire_append_u32(buffer, strlen(str));
+    g_byte_array_append(buffer, (const guint8 *) str, strlen(str) + 1);
+}
+
+static void wire_append_signature(GByteArray *buffer, const gchar *sig)
+{
+    guint8 length = strlen(sig);
+
+    g_byte_array_append(buffer, &length, 1);
+    g_byte_array_append(buffer, (const guint8 *) sig, length + 1);
+}
+
+// Alignment of a complete type in the D-Bus marshalling format.
+static gsize wire_alignment(const gchar *type)
+{
+    switch (*type) {
+        case 'y': case 'g': case 'v':
+            return 1;
+        case 'n': case 'q':
+            return 2;
+        case 'x': case 't': case 'd': case '(': case '{':
+            return 8;
+        default:
+            return 4;
+    }
+}
+
+// Append a value in the D-Bus marshalling format, in host byte order.
+static void wire_marshal(GByteArray *buffer, GVariant *value)
+{
+    union {
+        guint8  y;
+        gint16  n;
+        guint16 q;
+        gint32  i;
+        guint32 u;
+        gint64  x;
+        guint64 t;
+        gdouble d;
+    } basic;
+
+    switch (g_variant_classify(value)) {
+        case G_VARIANT_CLASS_BOOLEAN:
+            wire_append_u32(buffer, g_variant_get_boolean(value));
+            break;
+        case G_VARIANT_CLASS_BYTE:
+            basic.y = g_variant_get_byte(value);
+            wire_append(buffer, 1, &basic.y, sizeof basic.y);
+            break;
+        case G_VARIANT_CLASS_INT16:
+            basic.n = g_variant_get_int16(value);
+            wire_append(buffer, 2, &basic.n, sizeof basic.n);
+            break;
+        case G_VARIANT_CLASS_UINT16:
+            basic.q = g_variant_get_uint16(value);
+            wire_append(buffer, 2, &basic.q, sizeof basic.q);
+            break;
+        case G_VARIANT_CLASS_INT32:
+            basic.i = g_variant_get_int32(value);
+            wire_append(buffer, 4, &basic.i, sizeof basic.i);
+            break;
+        case G_VARIANT_CLASS_UINT32:
+            wire_append_u32(buffer, g_variant_get_uint32(value));
+            break;
+        case G_VARIANT_CLASS_HANDLE:
+            basic.i = g_variant_get_handle(value);
+            wire_append(buffer, 4, &basic.i, sizeof basic.i);
+            break;
+        case G_VARIANT_CLASS_INT64:
+            basic.x = g_variant_get_int64(value);
+            wire_append(buffer, 8, &basic.x, sizeof basic.x);
+            break;
+        case G_VARIANT_CLASS_UINT64:
+            basic.t = g_variant_get_uint64(value);
+            wire_append(buffer, 8, &basic.t, sizeof basic.t);
+            break;
+        case G_VARIANT_CLASS_DOUBLE:
+            basic.d = g_variant_get_double(value);
+            wire_append(buffer, 8, &basic.d, sizeof basic.d);
+            break;
+        case G_VARIANT_CLASS_STRING:
+        case G_VARIANT_CLASS_OBJECT_PATH:
+            wire_append_string(buffer, g_variant_get_string(value, NULL));
+            break;
+        case G_VARIANT_CLASS_SIGNATURE:
+            wire_append_signature(buffer, g_variant_get_string(value, NULL));
+            break;
+        case G_VARIANT_CLASS_VARIANT: {
+            GVariant *child = g_variant_get_variant(value);
+            wire_append_signature(buffer, g_variant_get_type_string(child));
+            wire_marshal(buffer, child);
+            g_variant_unref(child);
+            break;
+        }
+        case G_VARIANT_CLASS_ARRAY: {
+            guint32 offset;
+            guint32 start;
+            guint32 length;
+
+            // The length is filled in once the elements are written, it
+            // doesn't include the padding before the first element.
+            wire_append_u32(buffer, 0);
+            offset = buffer->len - sizeof(guint32);
+            wire_pad(buffer, wire_alignment(g_variant_get_type_string(value) + 1));
+            start = buffer->len;
+
+            for (gsize i = 0; i < g_variant_n_children(value); i++) {
+                GVariant *child = g_variant_get_child_value(value, i);
+                wire_marshal(buffer, child);
+                g_variant_unref(child);
+            }
+
+            length = buffer->len - start;
+            memcpy(buffer->data + offset, &length, sizeof length);
+            break;
+        }
+        case G_VARIANT_CLASS_TUPLE:
+        case G_VARIANT_CLASS_DICT_ENTRY:
+            wire_pad(buffer, 8);
+            for (gsize i = 0; i < g_variant_n_children(value); i++) {
+                GVariant *child = g_variant_get_child_value(value, i);
+                wire_marshal(buffer, child);
+                g_variant_unref(child);
+            }
+            break;
+        case G_VARIANT_CLASS_MAYBE:
+            // Not representable in D-Bus, GDBus would refuse to send it too.
+            g_warn_if_reached();
+            break;
+    }
+}
+
+static void wire_append_field(GByteArray *buffer, guint8 code, const gchar *type, const gchar *value)
+{
+    if (value == NULL) {
+        return;
+    }
+
+    wire_pad(buffer, 8);
+    g_byte_array_append(buffer, &code, 1);
+    wire_append_signature(buffer, type);
+
+    if (*type == 'g') {
+        wire_append_signature(buffer, value);
+    } else {
+        wire_append_string(buffer, value);
+    }
+}
+
+// Marshal a method call into wire->output, and return the serial.
+static guint32 wire_marshal_call(wire_transport_t *wire, GDBusMessage *msg)
+{
+    GVariant *body = g_dbus_message_get_body(msg);
+    GByteArray *buffer = wire->output;
+    gchar *signature = NULL;
+    guint32 fields;
+    guint32 length;
+    guint32 start;
+    guint8 header[4] = {
+        G_BYTE_ORDER == G_LITTLE_ENDIAN ? 'l' : 'B',
+        G_DBUS_MESSAGE_TYPE_METHOD_CALL,
+        g_dbus_message_get_flags(msg),
+        1,
+    };
+
+    g_byte_array_set_size(buffer, 0);
+
+    // Skip 0 if the serial wraps, it's not a valid serial.
+    if (++wire->serial == 0)
+        wire->serial++;
+
+    g_byte_array_append(buffer, header, sizeof header);
+    wire_append_u32(buffer, 0);                 // Body length.
+    wire_append_u32(buffer, wire->serial);
+    wire_append_u32(buffer, 0);                 // Header fields length.
+
+    fields = buffer->len;
+
+    // The body is always a tuple, the signature is its contents.
+    if (body && g_variant_n_children(body) > 0) {
+        const gchar *type = g_variant_get_type_string(body);
+        signature = g_strndup(type + 1, strlen(type) - 2);
+    }
+
+    wire_append_field(buffer, WIRE_FIELD_PATH, "o", g_dbus_message_get_path(msg));
+    wire_append_field(buffer, WIRE_FIELD_INTERFACE, "s", g_dbus_message_get_interface(msg));
+    wire_append_field(buffer, WIRE_FIELD_MEMBER, "s", g_dbus_message_get_member(msg));
+    wire_append_field(buffer, WIRE_FIELD_DESTINATION, "s", g_dbus_message_get_destination(msg));
+    wire_append_field(buffer, WIRE_FIELD_SIGNATURE, "g", signature);
+
+    length = buffer->len - fields;
+    memcpy(buffer->data + fields - sizeof(guint32), &length, sizeof length);
+
+    wire_pad(buffer, 8);
+    start = buffer->len;
+
+    if (signature) {
+        wire_marshal(buffer, body);
+    }
+
+    length = buffer->len - start;
+    memcpy(buffer->data + 4, &length, sizeof length);
+
+    g_free(signature);
+    return wire->serial;
+}
+
+static gboolean wire_write(gint fd, const guint8 *data, gsize size, GError **error)
+{
+    while (size > 0) {
+        gssize count = send(fd, data, size, MSG_NOSIGNAL);
+
+        if (count < 0 && errno == EINTR)
+            continue;
+
+        if (count <= 0) {
+            g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "failed to write to bus, %s", g_strerror(errno));
+            return false;
+        }
+
+        data += count;
+        size -= count;
+    }
+
+    return true;
+}
+
+// Wait until fd is readable, or the deadline passes if it's not -1.
+static gboolean wire_wait(gint fd, gint64 deadline, GError **error)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    gint wait = -1;
+    gint result;
+
+    if (deadline >= 0) {
+        wait = MAX(0, (deadline - g_get_monotonic_time()) / 1000);
+    }
+
+    do {
+        result = poll(&pfd, 1, wait);
+    } while (result < 0 && errno == EINTR);
+
+    if (result < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "failed to poll bus, %s", g_strerror(errno));
+        return false;
+    }
+
+    if (result == 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT, "timeout waiting for reply");
+        return false;
+    }
+
+    return true;
+}
+
+// Receive at least some of the next wanted bytes directly into wire->input,
+// waiting until the deadline.
+static gboolean wire_read(wire_transport_t *wire, gsize wanted, gint64 deadline, GError **error)
+{
+    gsize length = wire->input->len;
+    gsize room = MAX(wanted, WIRE_READ_SIZE);
+    gssize count;
+
+    if (!wire_wait(wire->fd, deadline, error)) {
+        return false;
+    }
+
+    // This only reallocates when the buffer has never held this much.
+    g_byte_array_set_size(wire->input, length + room);
+
+    do {
+        count = recv(wire->fd, wire->input->data + length, room, 0);
+    } while (count < 0 && errno == EINTR);
+
+    g_byte_array_set_size(wire->input, length + MAX(count, 0));
+
+    if (count <= 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_CLOSED, "bus connection closed");
+        return false;
+    }
+
+    return true;
+}
+
+// Read the next complete message from the bus.
+//
+// Returns NULL on error, or a message you should free with g_object_unref().
+static GDBusMessage * wire_receive(wire_transport_t *wire, gint64 deadline, GError **error)
+{
+    GDBusMessage *message;
+    gssize needed;
+
+    while (wire->input->len < WIRE_FIXED_HEADER_SIZE) {
+        if (!wire_read(wire, WIRE_FIXED_HEADER_SIZE - wire->input->len, deadline, error))
+            return NULL;
+    }
+
+    if ((needed = g_dbus_message_bytes_needed(wire->input->data, wire->input->len, error)) < 0) {
+        return NULL;
+    }
+
+    if (needed > WIRE_MAX_MESSAGE_SIZE) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "message too large");
+        return NULL;
+    }
+
+    while (wire->input->len < (gsize) needed) {
+        if (!wire_read(wire, needed - wire->input->len, deadline, error))
+            return NULL;
+    }
+
+    message = g_dbus_message_new_from_blob(wire->input->data, needed, G_DBUS_CAPABILITY_FLAGS_NONE, error);
+
+    g_byte_array_remove_range(wire->input, 0, needed);
+    return message;
+}
+
+// Tell the caller of a method that nothing is exported on this connection.
+// This is rare, so GDBus does the marshalling.
+static void wire_reject_call(wire_transport_t *wire, GDBusMessage *call)
+{
+    GDBusMessage *reply;
+    GError *error = NULL;
+    guchar *blob;
+    gsize size;
+
+    g_debug("rejecting %s.%s call from %s on native transport",
+            g_dbus_message_get_interface(call),
+            g_dbus_message_get_member(call),
+            g_dbus_message_get_sender(call));
+
+    if (g_dbus_message_get_flags(call) & G_DBUS_MESSAGE_FLAGS_NO_REPLY_EXPECTED) {
+        return;
+    }
+
+    reply = g_dbus_message_new_method_error(call,
+                                            "org.freedesktop.DBus.Error.UnknownMethod",
+                                            "No such interface or object path");
+
+    // Skip 0 if the serial wraps, it's not a valid serial.
+    if (++wire->serial == 0)
+        wire->serial++;
+
+    g_dbus_message_set_serial(reply, wire->serial);
+
+    if (!(blob = g_dbus_message_to_blob(reply, &size, G_DBUS_CAPABILITY_FLAGS_NONE, &error))
+     || !wire_write(wire->fd, blob, size, &error)) {
+        g_debug("failed to reject call, %s", error->message);
+        g_clear_error(&error);
+    }
+
+    g_free(blob);
+    g_object_unref(reply);
+}
+
+// Send a method call and wait for the reply. Signals and replies to calls
+// that previously timed out are discarded, method calls are rejected.
+//
+// Returns NULL on error, or a reply you should free with g_object_unref().
+GDBusMessage * wire_send_message(wire_transport_t *wire, GDBusMessage *msg, gint timeout_msec, GError **error)
+{
+    GDBusMessage *reply = NULL;
+    gint64 deadline = -1;
+    guint32 serial;
+
+    // Timeouts have the same meaning as in GDBus.
+    if (timeout_msec == -1) {
+        timeout_msec = WIRE_DEFAULT_TIMEOUT;
+    }
+
+    if (timeout_msec != G_MAXINT) {
+        deadline = g_get_monotonic_time() + timeout_msec * 1000LL;
+    }
+
+    g_mutex_lock(&wire->lock);
+
+    serial = wire_marshal_call(wire, msg);
+
+    if (!wire_write(wire->fd, wire->output->data, wire->output->len, error)) {
+        goto finished;
+    }
+
+    while ((reply = wire_receive(wire, deadline, error))) {
+        GDBusMessageType type = g_dbus_message_get_message_type(reply);
+
+        if ((type == G_DBUS_MESSAGE_TYPE_METHOD_RETURN || type == G_DBUS_MESSAGE_TYPE_ERROR)
+         && g_dbus_message_get_reply_serial(reply) == serial) {
+            break;
+        }
+
+        if (type == G_DBUS_MESSAGE_TYPE_METHOD_CALL) {
+            wire_reject_call(wire, reply);
+        }
+
+        g_object_unref(reply);
+    }
+
+  finished:
+    g_mutex_unlock(&wire->lock);
+    return reply;
+}
+
+// Read a line of the authentication conversation, waiting until the deadline.
+static gchar * wire_read_line(gint fd, gint64 deadline)
+{
+    GString *line = g_string_new(NULL);
+    GError *error = NULL;
+    gchar c;
+
+    // A byte at a time, so nothing after the line is consumed.
+    while (wire_wait(fd, deadline, &error) && read(fd, &c, 1) == 1) {
+        if (c == '\n')
+            return g_string_free(line, false);
+        if (c != '\r')
+            g_string_append_c(line, c);
+    }
+
+    if (error) {
+        g_warning("bus authentication failed, %s", error->message);
+        g_error_free(error);
+    }
+
+    g_string_free(line, true);
+    return NULL;
+}
+
+static gboolean wire_authenticate(gint fd)
+{
+    gchar *uid = g_strdup_printf("%u", getuid());
+    GString *request = g_string_new("AUTH EXTERNAL ");
+    gboolean result = false;
+    gchar *response;
+
+    for (gchar *p = uid; *p; p++) {
+        g_string_append_printf(request, "%02x", *p);
+    }
+
+    g_string_append(request, "\r\n");
+
+    // The credentials byte must be sent before anything else.
+    if (!wire_write(fd, (const guint8 *) "", 1, NULL)
+     || !wire_write(fd, (const guint8 *) request->str, request->len, NULL)) {
+        goto finished;
+    }
+
+    if (!(response = wire_read_line(fd, g_get_monotonic_time() + WIRE_DEFAULT_TIMEOUT * 1000LL))) {
+        goto finished;
+    }
+
+    if (g_str_has_prefix(response, "OK ")) {
+        result = wire_write(fd, (const guint8 *) "BEGIN\r\n", strlen("BEGIN\r\n"), NULL);
+    } else {
+        g_warning("bus rejected authentication, %s", response);
+    }
+
+    g_free(response);
+
+  finished:
+    g_string_free(request, true);
+    g_free(uid);
+    return result;
+}
+
+// Connect to the first unix socket in a D-Bus address.
+static gint wire_connect(const gchar *address)
+{
+    gchar **entries = g_strsplit(address, ";", 0);
+    gint fd = -1;
+
+    for (gchar **entry = entries; *entry && fd < 0; entry++) {
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+        socklen_t length = 0;
+        gchar **keys;
+
+        if (!g_str_has_prefix(*entry, "unix:"))
+            continue;
+
+        keys = g_strsplit(*entry + strlen("unix:"), ",", 0);
+
+        for (gchar **key = keys; *key; key++) {
+            gchar *value = g_uri_unescape_string(strchr(*key, '=') ? strchr(*key, '=') + 1 : "", NULL);
+
+            if (value && strlen(value) < sizeof(sun.sun_path) - 1) {
+                if (g_str_has_prefix(*key, "path=")) {
+                    strcpy(sun.sun_path, value);
+                    length = offsetof(struct sockaddr_un, sun_path) + strlen(value) + 1;
+                } else if (g_str_has_prefix(*key, "abstract=")) {
+                    strcpy(sun.sun_path + 1, value);
+                    length = offsetof(struct sockaddr_un, sun_path) + strlen(value) + 1;
+                }
+            }
+
+            g_free(value);
+        }
+
+        g_strfreev(keys);
+
+        if (length == 0)
+            continue;
+
+        if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+            continue;
+
+        if (connect(fd, (struct sockaddr *) &sun, length) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    g_strfreev(entries);
+    return fd;
+}
+
+// Open a native connection to the bus at address, and use it for synchronous
+// sends on bus.
+//
+// Returns false if it failed, and GDBus will be used as normal.
+gboolean attach_wire_transport(GDBusConnection *bus, const gchar *address)
+{
+    wire_transport_t *wire;
+    GDBusMessage *hello;
+    GDBusMessage *reply;
+    GError *error = NULL;
+    gint fd;
+
+    if ((fd = wire_connect(address)) < 0) {
+        g_warning("native transport only supports unix sockets, %s", address);
+        return false;
+    }
+
+    if (!wire_authenticate(fd)) {
+        close(fd);
+        return false;
+    }
+
+    wire            = g_new0(wire_transport_t, 1);
+    wire->fd        = fd;
+    wire->output    = g_byte_array_sized_new(4096);
+    wire->input     = g_byte_array_sized_new(16384);
+
+    g_mutex_init(&wire->lock);
+
+    hello = g_dbus_message_new_method_call("org.freedesktop.DBus",
+                                           "/org/freedesktop/DBus",
+                                           "org.freedesktop.DBus",
+                                           "Hello");
+
+    reply = wire_send_message(wire, hello, -1, &error);
+
+    g_object_unref(hello);
+
+    if (reply == NULL || g_dbus_message_get_message_type(reply) != G_DBUS_MESSAGE_TYPE_METHOD_RETURN) {
+        g_warning("native transport failed to register with the bus, %s", error ? error->message : "error reply");
+        g_clear_error(&error);
+        g_clear_object(&reply);
+        wire_transport_free(wire);
+        return false;
+    }
+
+    g_object_unref(reply);
+    g_object_set_data_full(G_OBJECT(bus), WIRE_DATA_KEY, wire, wire_transport_free);
+    return true;
+}
+
+wire_transport_t * get_wire_transport(GDBusConnection *bus)
+{
+    return g_object_get_data(G_OBJECT(bus), WIRE_DATA_KEY);
+}
@@ -0,0 +1,13 @@
+#ifndef __WIRE_H
+#define __WIRE_H
+
+typedef struct _wire_transport wire_transport_t;
+
+gboolean attach_wire_transport(GDBusConnection *bus, const gchar *address);
+wire_transport_t * get_wire_transport(GDBusConnection *bus);
+GDBusMessage * wire_send_message(wire_transport_t *wire, GDBusMessage *msg, gint timeout_msec, GError **error);
+
+// Options
+extern gboolean enable_wire_transport;
+
+#endif